@@ -0,0 +1,167 @@
+#include <iostream>
+#include <tuple>
+#include <algorithm>
+
+// User defined modules
+#include <Map.hpp>
+#include <Argparser.hpp>
+#include <path.hpp>
+#include <denoiser.hpp>
+
+// -- Maximum difference between two maps on the same grid {{{
+static float max_difference(const Map& lhs, const Map& rhs)
+{
+    float max_diff = 0.0f;
+
+    for (int e = 0; e < lhs.get_volume(); e++) {
+        max_diff = std::max(max_diff, std::abs(lhs[e] - rhs[e]));
+    }
+
+    return max_diff;
+}
+// -- }}}
+
+// -- Compare the incremental re-denoiser with a full rerun after a local change {{{
+static bool check_redenoise(Map& map, const float& perc_t, const float& r_env, const int& half)
+{
+    // Exact run keeping the state needed by the incremental one
+    Denoiser::DenoiserState state;
+    Denoiser::nlmeans_denoiser(map, perc_t, r_env, state);
+
+    // Change a box of side 2 * half + 1 around the centre of the grid
+    Map changed_map = map;
+    vector<bool> changed(changed_map.get_volume(), false);
+
+    const float delta = 0.01f * (changed_map.max_value() - changed_map.min_value());
+
+    for (int dw = -half; dw <= half; dw++) {
+        for (int dv = -half; dv <= half; dv++) {
+            for (int du = -half; du <= half; du++) {
+                const int e = changed_map.grid.index_s(
+                    changed_map.Nu / 2 + du, changed_map.Nv / 2 + dv, changed_map.Nw / 2 + dw
+                );
+                if (!changed[e]) changed_map[e] += delta;
+                changed[e] = true;
+            }
+        }
+    }
+
+    // Number of environments recomputed by the incremental run
+    const int num_affected = Denoiser::affected_envs(changed_map, changed, r_env).size();
+    const float old_hd = state.hd;
+
+    // Incremental update of the previous run and full run on the changed map
+    const auto incremental = Denoiser::nlmeans_redenoiser(changed_map, changed, state);
+    const auto full = Denoiser::nlmeans_denoiser(changed_map, perc_t, r_env);
+
+    const float max_diff  = max_difference(std::get<0>(incremental), std::get<0>(full));
+    const float tolerance = 1e-4f * (std::get<0>(full).max_value() - std::get<0>(full).min_value());
+    const bool passed = max_diff <= tolerance;
+
+    std::cout << Path::format_str(
+        " check redenoise: %d affected envs%s, max diff %g, tolerance %g, %s\n", num_affected,
+        std::get<1>(incremental) != old_hd ? " (h changed, full run)" : "",
+        max_diff, tolerance, passed ? "ok" : "FAILED"
+    );
+
+    return passed;
+}
+// -- }}}
+
+// -- Compare the graph of weights collected by the pairwise stage with its output {{{
+static bool check_graph(Map& map, const float& perc_t, const float& r_env, const float& graph_t)
+{
+    // Exact run collecting the weights above graph_t
+    Denoiser::DenoiserState state;
+    WeightGraph graph;
+
+    float* envs = Denoiser::table_of_envs(map, r_env);
+    const auto env_avg = Denoiser::table_of_stats(map, r_env);
+
+    const auto denoised = Denoiser::nlmeans_denoiser(
+        map, envs, env_avg, perc_t, r_env, state, &graph, graph_t
+    );
+    delete[] envs;
+
+    // Apply the collected graph to the same map
+    const Map applied = graph.apply(map);
+
+    // Only a graph containing all weights must reproduce the denoiser
+    const float max_diff  = max_difference(applied, std::get<0>(denoised));
+    const float tolerance = 1e-5f * (std::get<0>(denoised).max_value() - std::get<0>(denoised).min_value());
+    const bool passed = (graph_t > 0.0f) || max_diff <= tolerance;
+
+    std::cout << Path::format_str(
+        " check graph: %ld weights, threshold %g, max diff %g, tolerance %g, %s\n", graph.get_nnz(),
+        graph_t, max_diff, tolerance, graph_t > 0.0f ? "not checked (threshold > 0)" :
+        passed ? "ok" : "FAILED"
+    );
+
+    return passed;
+}
+// -- }}}
+
+int main(const int argc, char** argv)
+{
+    // Generate an argparser object to deal with command line input
+    const Argparser command_args(argc, argv);
+
+    if (command_args.check_flag("--help")) {
+        std::cout <<
+        "  -- check_denoise\n"
+        "  Usage:\n"
+        "  check_denoise --path [str] --name [str] --p [float] --r [float] --d [int] (optional)\n\n"
+        "  Compares the incremental and graph based paths of the denoiser with full\n"
+        "  runs of the pairwise stage on the same map. Fails if they differ.\n\n"
+        "  Arguments:\n"
+        "   --path: Path where the data is stored.   Example: ./data/rnase\n"
+        "   --name: Name of the map file to process. Example: ./refmac.map\n"
+        "   --p:    Percentage of the total spread of the map used to create the\n"
+        "           denoiser parameter.\n"
+        "   --r:    Radious of search used to create an environment.\n"
+        "   --d:    Device number (GPU) where the code will be located. Default 0.\n"
+        "  Optional arguments:\n"
+        "   --box:  Half side of the box changed at the centre of the map to check\n"
+        "           the incremental re-denoiser. Default 1.\n"
+        "   --graph-t: Minimum weight stored in the graph compared with the pairwise\n"
+        "           stage, in [0, 1). Only a threshold of 0 is checked. Default 0.\n"
+        "  Example:\n"
+        "  check_denoise --path data/rnase --name refmac.map --p 0.05 --r 2.0\n\n";
+        return 0;
+    }
+
+    const bool is_args = command_args.check_flag("--path") && command_args.check_flag("--name") &&
+        command_args.check_flag("--p") && command_args.check_flag("--r");
+
+    // Get the correct data from the argument parser
+    const std::string protein_path = command_args.get_flag("--path");
+    const std::string map_name     = command_args.get_flag("--name");
+    const float perc_t             = command_args.get_flag<float>("--p");
+    const float r_env              = command_args.get_flag<float>("--r");
+    const int device = command_args.check_flag("--d") ? command_args.get_flag<int>("--d") : 0;
+    const int half   = command_args.check_flag("--box") ? command_args.get_flag<int>("--box") : 1;
+    const float graph_t = command_args.check_flag("--graph-t") ? 
+        command_args.get_flag<float>("--graph-t") : 0.0f;
+
+    if (!is_args || half < 0 || graph_t < 0.0f || graph_t >= 1.0f) {
+        std::cerr << " ERROR: Command line arguments are incorrect\n";
+        return 1;
+    }
+
+    // Set the device GPU where the code will be launched
+    cudaSetDevice(device);
+
+    Map map(Path::join_path(protein_path, map_name));
+
+    // The box must fit inside the grid
+    if (2 * half + 1 > std::min({map.Nu, map.Nv, map.Nw})) {
+        std::cerr << " ERROR: Command line arguments are incorrect\n";
+        return 1;
+    }
+
+    // Run all checks, even if one of them fails
+    const bool redenoise_ok = check_redenoise(map, perc_t, r_env, half);
+    const bool graph_ok     = check_graph(map, perc_t, r_env, graph_t);
+
+return (redenoise_ok && graph_ok) ? 0 : 1;
+}
@@ -61,7 +61,10 @@ struct Map : public gemmi::Ccp4<float>
 
     // -- Global modifications of the map
     void normalise();
-    float add_noise(const float& = 1.0, const bool& = false);
+    float add_noise(
+        const float& = 1.0, const bool& = false, 
+        const unsigned int& = std::default_random_engine::default_seed
+    );
 
     // Save the map into a file
     void save_map(const std::string&);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+
+// User defined modules
+#include "octanct.hpp"
+
+// Use the standard library vector
+using std::vector;
+
+// Namespace containing the clustering of environments used by the approximate denoiser
+namespace Cluster
+{
+    // -- Result of clustering the environments {{{
+    struct Clusters
+    {
+        int K;                   // Number of clusters
+        vector<float> centroids; // Centroid of each cluster (K * No)
+        vector<int> labels;      // Cluster of each environment (Ne)
+        vector<int> counts;      // Number of environments in each cluster (K)
+    };
+    // -- }}}
+
+    // -- Environments rotated to a canonical orientation {{{
+    float* canonical_envs(const float*, const int&);
+    // -- }}}
+
+    // -- Parallel mini-batch k-means on the environment descriptors {{{
+    Clusters minibatch_kmeans(const float*, const int&, const int&, const int& = 1024, const int& = 100);
+    // -- }}}
+
+    // -- Table containing the M nearest clusters to each cluster (K * M) {{{
+    vector<int> nearest_clusters(const Clusters&, const int&);
+    // -- }}}
+};
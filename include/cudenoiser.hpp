@@ -19,4 +19,35 @@ namespace Cudenoiser
     __global__ void update_denoiser(
         float*, float*, float*, float*, const int, const int, const int, const float 
     );
+
+    // Function to update K denoised maps sharing the kernels for a given reference
+    __global__ void update_joint(
+        float*, float*, float*, float*, const int, const int, const int, const int, const float
+    );
+
+    // Function to store the kernels above a threshold for a given reference
+    __global__ void collect_weights(
+        int*, int*, float*, int*, const int, float*, const int, const int, const int, 
+        const float, const float
+    );
+
+    // Function to replace the old contributions of all pairs containing a changed env
+    __global__ void update_pairs(
+        float*, float*, const float*, const float*, const float*, const float*,
+        const octanct*, const unsigned char*, const int, const int, const int, 
+        const int, const float
+    );
+
+    // Function to denoise each environment using its nearest clusters and centroids
+    __global__ void approx_denoiser(
+        float*, float*, float*, const float*, const float*, const int*, const int*, 
+        const int*, const float*, const float*, const int*, const octanct*, const int, 
+        const int, const int, const int, const int, const float
+    );
+
+    // Function to compute the exhaustive sum of kernels of some environments
+    __global__ void exhaustive_mass(
+        float*, const int*, const float*, const octanct*, const int, const int, 
+        const int, const int, const float
+    );
 };
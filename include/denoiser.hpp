@@ -14,6 +14,11 @@
 #include "Map.hpp"
 #include "stats.hpp"
 #include "cudenoiser.hpp"
+#include "weightgraph.hpp"
+#include "cluster.hpp"
+#include "taskgraph.hpp"
+#include "numa.hpp"
+#include "perf.hpp"
 
 // Some definitions to clean the code
 #define grid_point gemmi::GridBase<float>::Point
@@ -27,8 +32,48 @@ using namespace Cudenoiser;
 // Namespace containing all relevant functions to denoise maps
 namespace Denoiser
 {
+    // -- Data of a previous run needed to re-denoise a map incrementally {{{
+    struct DenoiserState
+    {
+        float p_thresh;        // Threshold used to compute the denoising parameter
+        float r_env;           // Radius used to construct the environments
+        float hd;              // Denoising parameter of the run
+
+        vector<float> omap;    // Map values used in the accumulators (Ne)
+        vector<float> envs;    // Table of environments (Ne * No)
+        vector<float> env_avg; // Table of environment averages (Ne)
+        vector<float> dmap;    // Unnormalised denoised map (Ne)
+        vector<float> sumk;    // Sum of kernels of each point (Ne)
+    };
+    // -- }}}
+
     // -- Basic function used for denoising {{{
     std::tuple<Map, float> nlmeans_denoiser(Map&, const float&, const float&);
+    std::tuple<Map, float> nlmeans_denoiser(Map&, const float&, const float&, DenoiserState&);
+    std::tuple<Map, float> nlmeans_denoiser(
+        Map&, const float*, const vector<float>&, const float&, const float&, DenoiserState&,
+        WeightGraph* = nullptr, const float& = 0.0f
+    );
+    float denoising_parameter(const vector<float>&, const float&);
+    // -- }}}
+
+    // -- Denoise several maps on the same grid sharing the kernels of a guide {{{
+    std::tuple<vector<Map>, float> nlmeans_joint(
+        vector<Map>&, const float*, const vector<float>&, const float&
+    );
+    Map average_map(const vector<Map>&);
+    // -- }}}
+
+    // -- Approximate denoiser comparing each environment with its nearest clusters {{{
+    std::tuple<Map, float, float> nlmeans_approx(
+        Map&, const float*, const vector<float>&, const float&, const int& = 0, const int& = 3
+    );
+    // -- }}}
+
+    // -- Re-denoise a map after localised changes using a previous run {{{
+    std::tuple<Map, float> nlmeans_redenoiser(Map&, DenoiserState&);
+    std::tuple<Map, float> nlmeans_redenoiser(Map&, const vector<bool>&, DenoiserState&);
+    vector<int> affected_envs(Map&, const vector<bool>&, const float&);
     // -- }}}
 
     // -- Indices of the grid whose distance to a central point is less than a given one {{{
@@ -37,6 +82,7 @@ namespace Denoiser
 
     // -- Calculate the environments, their averages and standard deviation {{{
     float* table_of_envs(Map&, const float&);
+    void table_of_envs(Map&, const float&, float*);
     // -- }}}
 
     // -- Assign all points in the environment to the correct octanct {{{
@@ -46,5 +92,6 @@ namespace Denoiser
 
     // -- Construct a table containing the average of each environment {{{
     vector<float> table_of_stats(Map&, const float&);
+    void table_of_stats(Map&, const float&, float*);
     // -- }}}
 };
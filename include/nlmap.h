@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+ * C interface of libnlmap. It exposes the loading of CCP4 maps, the construction
+ * of environments, the table of environment averages and the non-local means
+ * denoiser over caller-owned float buffers, so the library can be used from other
+ * languages without going through files.
+ *
+ * All buffers of map values contain Nu * Nv * Nw floats ordered with u as the
+ * fastest index, which is the memory layout of the map grid. The table of
+ * environments contains Nu * Nv * Nw * 8 floats, one row of octanct averages per
+ * point. The input values are copied once into a working map of the library,
+ * while the results are written directly into the output buffers.
+ * Functions returning int return 0 on success and -1 on failure; a
+ * description of the last failure can be obtained using nlmap_last_error.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Opaque handle to a map loaded by the library
+typedef struct nlmap_map nlmap_map;
+
+// -- Description of the last error produced in the calling thread
+const char* nlmap_last_error(void);
+
+// -- Set the device (GPU) used by the denoiser in the calling thread
+int nlmap_set_device(int device);
+
+// -- Load a map from a CCP4 file. Returns NULL on failure
+nlmap_map* nlmap_map_load(const char* path);
+
+// -- Release the memory used by a map
+void nlmap_map_free(nlmap_map* map);
+
+// -- Dimensions of the grid of the map (Nu, Nv, Nw)
+int nlmap_map_shape(const nlmap_map* map, int shape[3]);
+
+// -- Pointer to the values stored in the map grid
+float* nlmap_map_data(nlmap_map* map);
+
+// -- Save some values in a CCP4 file using the grid of map. NULL uses the map values
+int nlmap_map_save(const nlmap_map* map, const float* values, const char* path);
+
+// -- Table of environments of the values on the grid of map. NULL uses the map values
+int nlmap_envs(const nlmap_map* map, const float* values, float r_env, float* envs);
+
+// -- Table of environment averages of the values on the grid of map
+int nlmap_stats(const nlmap_map* map, const float* values, float r_env, float* stats);
+
+// -- Denoise the values on the grid of map. The denoising parameter is stored in hd
+int nlmap_denoise(
+    const nlmap_map* map, const float* values, float p_thresh, float r_env,
+    float* denoised, float* hd
+);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstddef>
+
+// Namespace containing the placement of threads and data on the NUMA nodes of the host
+namespace Numa
+{
+    // -- Placement options, set once by the caller before running the stages {{{
+    struct Options
+    {
+        bool pin        = false; // Pin the threads of parallel loops to the nodes
+        bool replicate  = false; // Keep one read-only copy of shared tables per node
+        bool huge_pages = false; // Back large tables with transparent huge pages
+    };
+
+    Options& options();
+    // -- }}}
+
+    // -- Topology of the host, read from /sys/devices/system/node {{{
+    // Nodes are numbered consecutively from 0, skipping the nodes without CPUs
+    int num_nodes();
+    const std::vector<int>& node_cpus(const int&);
+    // -- }}}
+
+    // -- Node assigned to the thread t of a loop using Nt threads {{{
+    int node_of_thread(const int&, const int&);
+    // -- }}}
+
+    // -- Pin the calling thread to the CPUs of a node, unpin it and get its current node {{{
+    void pin_to_node(const int&);
+    void unpin();
+    int current_node();
+    // -- }}}
+
+    // -- Request transparent huge pages for a region before it is first touched {{{
+    void advise_huge_pages(void*, const size_t&);
+    // -- }}}
+
+    // -- Release the pages of a zero filled region, so they are first touched again {{{
+    void release_pages(void*, const size_t&);
+    // -- }}}
+
+    // -- Summary of the topology and the options used in the run {{{
+    std::string summary();
+    // -- }}}
+
+    // -- Read-only table with one copy per node {{{
+    template <typename T>
+    class Replicated
+    {
+    public:
+        // Copy n elements of data to each node. Each copy is allocated and filled
+        // by a thread pinned to its node, so its pages are local to the node
+        Replicated(const T* data, const size_t& n) : origin(data)
+        {
+            if (!options().replicate || num_nodes() < 2) return;
+
+            this->copies.resize(num_nodes());
+
+            std::vector<std::thread> threads;
+
+            for (int node = 0; node < num_nodes(); node++) {
+                threads.emplace_back([this, data, n, node]() {
+                    pin_to_node(node);
+                    this->copies[node].assign(data, data + n);
+                });
+            }
+
+            for (auto& thread : threads) thread.join();
+        }
+
+        // Copy located on the node of the calling thread, or the first copy if the
+        // node is not known
+        const T* local() const
+        {
+            if (this->copies.empty()) return this->origin;
+
+            const int node = current_node();
+            return (node >= 0 && node < (int) this->copies.size()) ? 
+                this->copies[node].data() : this->copies[0].data();
+        }
+
+    private:
+        const T* origin;
+        std::vector<std::vector<T>> copies;
+    };
+    // -- }}}
+};
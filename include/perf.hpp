@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+// Namespace containing the hardware performance counters of the stages (Linux perf_event_open)
+namespace Perf
+{
+    // -- Counted hardware events {{{
+    enum Event { Cycles, Instructions, LLCMisses, BranchMisses, DTLBMisses, NumEvents };
+    // -- }}}
+
+    // -- Enable the collection of counters, disabled by default {{{
+    bool& enabled();
+    // -- }}}
+
+    // -- Counters of the calling thread while the scope is alive {{{
+    class Scope
+    {
+    public:
+        // Open the counters of the calling thread for the given phase
+        explicit Scope(const std::string&);
+
+        // Read the counters and store a record of the phase and thread
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        // Phase measured, work done in the scope and the unit used to measure it
+        const std::string phase;
+        uint64_t items = 0;
+        std::string unit = "voxels";
+
+    private:
+        int fds[NumEvents];
+        Scope* parent;
+    };
+    // -- }}}
+
+    // -- Add work to the innermost scope of the calling thread {{{
+    void add_items(const uint64_t&, const std::string& = "voxels");
+    // -- }}}
+
+    // -- Phase of the innermost scope of the calling thread, empty if none {{{
+    std::string current_phase();
+    // -- }}}
+
+    // -- Output the counters per phase and thread and the derived metrics {{{
+    void report(std::ostream&);
+    // -- }}}
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// User defined modules
+#include "Map.hpp"
+
+// Namespace containing the input and output of maps through pipes and file descriptors
+namespace Stream
+{
+    // -- Read a map from a file, or from stdin if the path is "-" {{{
+    Map read_map(const std::string&, const float& = 0.0f);
+    // -- }}}
+
+    // -- Write a map into a file descriptor using large sequential chunks {{{
+    void write_map(const int&, Map&);
+    // -- }}}
+
+    // -- Write the environment averages of a map into a file descriptor {{{
+    void write_envstats(const int&, const std::vector<float>&, const Map&);
+    // -- }}}
+
+    // -- Write a buffer into a file descriptor, retrying partial writes {{{
+    void write_fd(const int&, const char*, const size_t&);
+    // -- }}}
+};
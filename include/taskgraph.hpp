@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <ostream>
+#include <chrono>
+
+namespace Tasks
+{
+    // -- Pool of threads executing the jobs submitted to it {{{
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(const int& = std::thread::hardware_concurrency());
+        ~ThreadPool();
+
+        // Queue a job to be executed by the first free worker
+        void submit(std::function<void()>);
+
+        // Number of workers in the pool
+        int size() const;
+
+    private:
+        std::vector<std::thread> workers;
+        std::queue<std::function<void()>> jobs;
+        std::mutex lock;
+        std::condition_variable available;
+        bool stop = false;
+    };
+    // -- }}}
+
+    // -- Split the range [0, n) in chunks processed by the calling thread and its pool {{{
+    void parallel_for(const int&, const std::function<void(int, int)>&);
+    // -- }}}
+
+    // -- Directed acyclic graph of tasks executed on a thread pool {{{
+    class TaskGraph
+    {
+    public:
+        // Add a task depending on previously added tasks. Returns its identifier
+        int add_task(const std::string&, std::function<void()>, const std::vector<int>& = {});
+
+        // Execute all tasks respecting their dependencies. Rethrows the first failure
+        void run(ThreadPool&);
+
+        // Chain of dependent tasks with the largest accumulated time
+        std::vector<int> critical_path() const;
+
+        // Output the timings of each task and the critical path
+        void report(std::ostream&) const;
+
+    private:
+        struct Task
+        {
+            std::string name;
+            std::function<void()> func;
+            std::vector<int> deps;
+            std::vector<int> children;
+            int pending;
+            bool skip;
+            double start, end;
+        };
+
+        // Execute a task and schedule its children when they are ready
+        void execute(ThreadPool&, const int&);
+
+        std::vector<Task> tasks;
+        std::mutex lock;
+        std::condition_variable finished;
+        int done = 0;
+        std::exception_ptr failure;
+        std::chrono::steady_clock::time_point origin;
+    };
+    // -- }}}
+};
@@ -10,6 +10,10 @@ namespace Utils
     template <typename T>
     void save_envstats(const T, const std::vector<float>&, const Map&);
 
+    // -- Write the environment average into an output stream
+    template <typename S>
+    void write_envstats(S&, const std::vector<float>&, const Map&);
+
     // -- Save the prefilter statistics in a file
     template <typename T>
     void save_stats(const T, const std::vector<float>&);
@@ -25,23 +29,26 @@ void Utils::save_envstats(
     // Open the stream
     stream.open(path, std::ios::out);
 
-    if (stream.is_open()) {
-
-        // Flush some important data in the stream
-        stream << -3 << " " << map.min_value() << "\n";
-        stream << -2 << " " << map.max_value() << "\n";
-        stream << -1 << " " << map.avg_value() << "\n";
-
-        // Flush the environments stats into the stream
-        for (int e = 0; e < map.get_volume(); e++) {
-            stream << e << " " << estat[e] <<  "\n";
-        }
-    }
+    if (stream.is_open()) write_envstats(stream, estat, map);
 
     // Close the stream
     stream.close();
 }
 
+template <typename S>
+void Utils::write_envstats(S& stream, const std::vector<float>& estat, const Map& map)
+{
+    // Flush some important data in the stream
+    stream << -3 << " " << map.min_value() << "\n";
+    stream << -2 << " " << map.max_value() << "\n";
+    stream << -1 << " " << map.avg_value() << "\n";
+
+    // Flush the environments stats into the stream
+    for (int e = 0; e < map.get_volume(); e++) {
+        stream << e << " " << estat[e] <<  "\n";
+    }
+}
+
 template <typename T>
 void Utils::save_stats(const T path, const std::vector<float>& stats)
 {
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// User defined modules
+#include "Map.hpp"
+
+/*
+ * Sparse graph containing the kernel weights between environments computed by the
+ * denoiser. Only the weights above a threshold are kept. The graph is stored in
+ * compressed sparse row (CSR) format: the weights of the row e are located in the
+ * positions [row_ptr[e], row_ptr[e + 1]) of col and val. The graph is symmetric
+ * and the self-weight of each point is counted twice, as in the denoiser.
+ *
+ * Applying the graph to a map on the same grid gives the non-local means estimate
+ * of the map using the stored weights,
+ *
+ *          out[e] = sum_j w[e, j] * map[j] / sum_j w[e, j].
+ *
+ * The binary format contains a header (magic "NLWG", version, Nu, Nv, Nw,
+ * threshold, hd, number of weights) followed by row_ptr, col and val.
+ */
+
+struct WeightGraph
+{
+    // -- Constructors and destructors
+    WeightGraph() = default; ~WeightGraph() = default;
+    WeightGraph(const std::string&);
+    WeightGraph(
+        const Map&, const std::vector<int>&, const std::vector<int>&,
+        const std::vector<float>&, const float&, const float&
+    );
+
+    // -- Properties of the graph
+    int get_volume() const;
+    long int get_nnz() const;
+
+    // -- Apply the graph to the values of a map on the same grid
+    void apply(const float*, float*, const float& = 0.0f) const;
+    Map apply(const Map&, const float& = 0.0f) const;
+
+    // -- Save the graph into a file
+    void save_graph(const std::string&) const;
+
+    // -- Fields of the class {{{
+    int Nu = 0, Nv = 0, Nw = 0;   // Dimensions of the grid
+    float threshold = 0.0f;       // Minimum weight stored in the graph
+    float hd = 0.0f;              // Denoising parameter used to compute the weights
+
+    std::vector<int64_t> row_ptr; // Start of each row in col and val (Ne + 1)
+    std::vector<int> col;         // Column of each weight
+    std::vector<float> val;       // Value of each weight
+    // -- }}}
+};
@@ -1,5 +1,10 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <tuple>
+#include <cctype>
+#include <algorithm>
+#include <unistd.h>
 
 // User defined modules
 #include <Map.hpp>
@@ -8,6 +13,11 @@
 #include <denoiser.hpp>
 #include <utils.hpp>
 #include <stats.hpp>
+#include <taskgraph.hpp>
+#include <weightgraph.hpp>
+#include <numa.hpp>
+#include <perf.hpp>
+#include <stream.hpp>
 
 int main(const int argc, char** argv)
 {
@@ -25,13 +35,49 @@ int main(const int argc, char** argv)
         "  Arguments:\n"
         "   --path: Path where the data is stored.   Example: ./data/rnase\n"
         "   --name: Name of the map file to process. Example: ./refmac.map\n"
+        "           Several maps on the same grid can be denoised together\n"
+        "           using a comma separated list. Example: half1.map,half2.map\n"
         "   --s:    Standard deviation of the noise add. If zero, no noise added\n"
+        "           Each map in --name gets an independent realisation.\n"
         "   --p:    Percentage of the total spread of the map used to create the\n"
         "           denoiser parameter.\n"
         "   --r:    Radious of search used to create an environment.\n"
         "   --d:    Device number (GPU) where the code will be located. Default 0.\n"
+        "  Optional arguments:\n"
+        "   --graph-out: File where the graph of kernel weights will be stored.\n"
+        "   --graph-t:   Minimum weight stored in the graph, in [0, 1). Default 0.001.\n"
+        "   --graph-in:  File containing a graph of weights computed on the same\n"
+        "                grid. The graph is applied to the map instead of running\n"
+        "                the pairwise stage. Weights are rescaled to the new --p.\n"
+        "                Cannot be combined with --graph-out.\n"
+        "   --graph-it:  Number of times the graph is applied, at least 1. Default 1.\n"
+        "   --guide:     Map whose environments define the kernels when several\n"
+        "                maps are denoised together. Index of the map in --name\n"
+        "                or avg to use the averaged environments. Default avg.\n"
+        "   --approx:    Number of clusters of environments used by the approximate\n"
+        "                denoiser. Zero uses sqrt of the number of points.\n"
+        "   --approx-m:  Number of nearest clusters compared exactly. Default 3.\n"
+        "   --numa:      Pin the threads of the host stages to the NUMA nodes, so\n"
+        "                the tables are first touched and read on the same node.\n"
+        "   --numa-replicate: Keep a read-only copy of the randomly accessed tables\n"
+        "                on each NUMA node.\n"
+        "   --huge-pages: Back the table of environments with huge pages.\n"
+        "   --perf:      Collect hardware counters per stage and thread into perf.log.\n"
+        "  Streaming arguments:\n"
+        "   --in:          Map file to process instead of --path and --name. If -, the\n"
+        "                  map is read from stdin.\n"
+        "   --out:         File where the denoised map is written. If -, the map is\n"
+        "                  written to stdout. If any output is written to stdout,\n"
+        "                  h is output to stderr.\n"
+        "   --noisy-fd:    File descriptor where the noisy map is written.\n"
+        "   --denoised-fd: File descriptor where the denoised map is written.\n"
+        "   --stats-fd:    File descriptor where the denoised envstats are written.\n"
+        "                  Each streamed output needs a different descriptor.\n"
+        "                  If any streaming output is used, the out tree only\n"
+        "                  contains the logs of the run.\n"
         "  Example:\n"
-        "  denoise_map --path data/rnase --name refmac.map --s 0.0 --p 0.05 --r 2.0 --d 0\n\n";
+        "  denoise_map --path data/rnase --name refmac.map --s 0.0 --p 0.05 --r 2.0 --d 0\n"
+        "  make_map | denoise_map --in - --out - --s 0.0 --p 0.05 --r 2.0 | cinvfft\n\n";
         return 0;
     }
 
@@ -42,9 +88,10 @@ int main(const int argc, char** argv)
     const bool is_p     = command_args.check_flag("--p");
     const bool is_r     = command_args.check_flag("--r");
     const bool is_d     = command_args.check_flag("--d");
+    const bool is_in    = command_args.check_flag("--in");
 
-    if (!is_path || !is_name || !is_s || !is_p || !is_r) {
-        std::cout << " ERROR: Command line arguments are incorrect\n";
+    if ((!is_in && (!is_path || !is_name)) || !is_s || !is_p || !is_r) {
+        std::cerr << " ERROR: Command line arguments are incorrect\n";
         return 1;
     }
 
@@ -53,80 +100,379 @@ int main(const int argc, char** argv)
 
     // Get the correct data from the argument parser
     const std::string protein_path = command_args.get_flag("--path");
-    const std::string map_name     = command_args.get_flag("--name");
+    const std::string map_list     = command_args.get_flag("--name");
     const float sigma              = command_args.get_flag<float>("--s");
     const float perc_t             = command_args.get_flag<float>("--p");
     const float r_env              = command_args.get_flag<float>("--r");
 
+    // Options used to store or reuse the graph of kernel weights
+    const std::string graph_out = command_args.get_flag("--graph-out");
+    const std::string graph_in  = command_args.get_flag("--graph-in");
+    const float graph_t = command_args.check_flag("--graph-t") ? 
+        command_args.get_flag<float>("--graph-t") : 1e-3f;
+    const int graph_it  = command_args.check_flag("--graph-it") ? 
+        command_args.get_flag<int>("--graph-it") : 1;
+
+    // Options of the approximate denoiser based on clusters of environments
+    const bool is_approx = command_args.check_flag("--approx");
+    const int approx_k   = is_approx ? command_args.get_flag<int>("--approx") : 0;
+    const int approx_m   = command_args.check_flag("--approx-m") ? 
+        command_args.get_flag<int>("--approx-m") : 3;
+
+    // Names of the maps to process, all of them are denoised together
+    vector<std::string> map_names;
+    std::stringstream map_stream(map_list);
+
+    for (std::string name; std::getline(map_stream, name, ',');) {
+        if (!name.empty()) map_names.push_back(name);
+    }
+
+    // A single map given by --in replaces the maps in --path
+    if (is_in) {
+        map_names.clear();
+        if (!command_args.get_flag("--in").empty()) map_names.push_back(command_args.get_flag("--in"));
+    }
+
+    // Number of maps denoised together
+    const int K = map_names.size();
+
+    // Index of the guide map, negative values imply the averaged environments
+    const std::string guide = command_args.check_flag("--guide") ? 
+        command_args.get_flag("--guide") : "avg";
+    const bool guide_is_index = !guide.empty() && guide.size() < 10 && 
+        std::all_of(guide.begin(), guide.end(), [](const char& c) { return std::isdigit(c); });
+    const bool guide_ok  = (guide == "avg") || guide_is_index;
+    const int  guide_idx = (K == 1) ? 0 : guide_is_index ? std::stoi(guide) : -1;
+
+    // Placement of the host stages on multi-socket hosts
+    Numa::options().pin        = command_args.check_flag("--numa");
+    Numa::options().replicate  = command_args.check_flag("--numa-replicate");
+    Numa::options().huge_pages = command_args.check_flag("--huge-pages");
+
+    // Collect the hardware counters of each stage if requested
+    Perf::enabled() = command_args.check_flag("--perf");
+
+    // Outputs streamed into a file or file descriptors instead of the out tree
+    const std::string map_out = command_args.get_flag("--out");
+    const int noisy_fd    = command_args.check_flag("--noisy-fd") ? 
+        command_args.get_flag<int>("--noisy-fd") : -1;
+    const int denoised_fd = command_args.check_flag("--denoised-fd") ? 
+        command_args.get_flag<int>("--denoised-fd") : -1;
+    const int stats_fd    = command_args.check_flag("--stats-fd") ? 
+        command_args.get_flag<int>("--stats-fd") : -1;
+    const bool streaming  = command_args.check_flag("--out") || 
+        noisy_fd >= 0 || denoised_fd >= 0 || stats_fd >= 0;
+
+    // Descriptors written by the streamed outputs, --out - corresponds to stdout
+    vector<int> stream_fds;
+    if (map_out == "-")   stream_fds.push_back(STDOUT_FILENO);
+    if (noisy_fd >= 0)    stream_fds.push_back(noisy_fd);
+    if (denoised_fd >= 0) stream_fds.push_back(denoised_fd);
+    if (stats_fd >= 0)    stream_fds.push_back(stats_fd);
+
+    // The outputs are written by concurrent tasks, so they cannot share a descriptor
+    std::sort(stream_fds.begin(), stream_fds.end());
+    const bool unique_fds = 
+        std::adjacent_find(stream_fds.begin(), stream_fds.end()) == stream_fds.end();
+
+    // If stdout contains a streamed output, h is printed to stderr
+    const bool stdout_used = std::binary_search(stream_fds.begin(), stream_fds.end(), STDOUT_FILENO);
+
+    // Streaming only processes a single map and --out needs a value
+    const bool stream_ok = !streaming || (K == 1 && unique_fds &&
+        !(command_args.check_flag("--out") && map_out.empty()));
+
+    // The approximate denoiser only processes a single map
+    const bool approx_ok = !is_approx || (K == 1 && graph_out.empty() && graph_in.empty());
+
+    // The graph is collected in the exact single map run. The threshold must keep
+    // the self-weight, exp(0) = 1, so every row of the graph contains a weight
+    // An applied graph is not stored again and is applied at least once
+    const bool graph_ok = (graph_t >= 0.0f && graph_t < 1.0f) && (K == 1 || graph_out.empty()) &&
+        (graph_out.empty() || graph_in.empty()) && graph_it >= 1;
+
+    if (K == 0 || !guide_ok || guide_idx >= K || !graph_ok || !approx_ok || approx_m < 1 || 
+        !stream_ok) {
+        std::cerr << " ERROR: Command line arguments are incorrect\n";
+        return 1;
+    }
+
     // Set the device GPU where the code will be launched
     cudaSetDevice(device);
 
-    // Obtain the name of the protein from the protein path
-    const auto protein = Path::get_basename(protein_path);
+    // Obtain the name of the protein from the protein path, or from the input file
+    // if the map is not read from stdin
+    const std::string in_name = Path::get_basename(command_args.get_flag("--in")).empty() ? 
+        command_args.get_flag("--in") : Path::get_basename(command_args.get_flag("--in"));
+    const auto protein = is_path ? Path::get_basename(protein_path) : 
+        (in_name == "-") ? std::string("stdin") : in_name;
+
+    // Load all Map files from memory
+    vector<Map> original_maps;
+    original_maps.reserve(K);
+
+    for (const auto& map_name : map_names) {
+        original_maps.push_back(
+            is_in ? Stream::read_map(map_name) : Map(Path::join_path(protein_path, map_name))
+        );
+
+        // Add some noise to the map according to sigma. Each map uses its own seed,
+        // so the noise of the maps denoised together is independent
+        original_maps.back().add_noise(
+            sigma, false, std::default_random_engine::default_seed + original_maps.size() - 1
+        );
+    }
+
+    // Maps denoised together are indexed together, so they must share the grid
+    for (const auto& map : original_maps) {
+        if (map.Nu != original_maps[0].Nu || map.Nv != original_maps[0].Nv || 
+            map.Nw != original_maps[0].Nw) {
+            std::cerr << " ERROR: Command line arguments are incorrect\n";
+            return 1;
+        }
+    }
+
+    // Copy of the noisy maps saved while the denoiser reads the original ones, as
+    // saving a map updates its header
+    vector<Map> noisy_maps(original_maps.begin(), original_maps.end());
+
+    // Map whose environments define the kernels
+    Map average_map;
+    if (guide_idx < 0) average_map = Denoiser::average_map(original_maps);
+    Map& guide_map = (guide_idx < 0) ? average_map : original_maps[guide_idx];
+
+    // Objects shared between the different stages of the run
+    const float* envs = nullptr;
+    vector<vector<float>> noisy_env_stats(K), denoised_env_stats(K);
+    vector<float> average_env_stats;
+    vector<Map> denoised_maps;
+    Denoiser::DenoiserState state;
+    WeightGraph graph;
+    float denoise_param = 0.0f, captured_mass = 1.0f;
+    std::string n_files_path, d_files_path, n_log_path, d_log_path, logs_path;
+
+    // Environment averages of the guide map
+    const auto guide_env_stats = [&]() -> const vector<float>& {
+        return (guide_idx < 0) ? average_env_stats : noisy_env_stats[guide_idx];
+    };
 
-    // Load a Map file from memory
-    Map original_map(Path::join_path(protein_path, map_name));
+    // Name of the outputs and tasks of each map, suffixed by its index if K > 1
+    const auto suffixed = [K](const std::string& base, const int& k, const std::string& ext) {
+        return (K == 1) ? base + ext : base + "_" + std::to_string(k) + ext;
+    };
 
-    // Add some noise to the map according to sigma
-    original_map.add_noise(sigma);
+    // Graph containing all stages of the run and their dependencies
+    Tasks::TaskGraph tasks;
 
-    // Denoise the map using the map denoiser
-    auto denoiser_output = Denoiser::nlmeans_denoiser(original_map, perc_t, r_env);
+    // Calculate the environment statistics of the noisy maps
+    vector<int> t_nstats(K);
 
-    // References to the objects encoded in the denoiser output
-    auto& denoised_map       = std::get<0>(denoiser_output);
-    auto& denoise_param      = std::get<1>(denoiser_output);
+    for (int k = 0; k < K; k++) {
+        t_nstats[k] = tasks.add_task(suffixed("noisy_stats", k, ""), [&, k]() {
+            noisy_env_stats[k] = Denoiser::table_of_stats(original_maps[k], r_env);
+        });
+    }
+
+    // Statistics of the guide map, only computed if it is not one of the maps
+    const int t_gstats = (guide_idx >= 0) ? t_nstats[guide_idx] :
+        tasks.add_task("guide_stats", [&]() {
+            average_env_stats = Denoiser::table_of_stats(average_map, r_env);
+        });
+
+    // Generate the paths where the data will be stored, they need the parameter h
+    const int t_paths = tasks.add_task("paths", [&]() {
+        denoise_param = Denoiser::denoising_parameter(guide_env_stats(), perc_t);
+
+        // Generate the path where the maps will be stored
+        const auto maps_path = Path::format_str(
+            "out/data/%s/s%.4f_h%.4f_r%.4f_p%.4f",
+            protein.c_str(), sigma, denoise_param, r_env, perc_t
+        );
+
+        // Generate the path where the log will be output
+        logs_path = Path::format_str(
+           "out/log/%s/s%.4f_h%.4f_r%.4f_p%.4f",
+           protein.c_str(), sigma, denoise_param, r_env, perc_t
+        );
+
+        // Create the basic directories if needed
+        Path::make_path(maps_path); 
+        Path::make_path(logs_path);
+
+        // Paths to the noisy and denoised data
+        n_files_path = Path::join_path(maps_path, "noisy/files");
+        d_files_path = Path::join_path(maps_path, "denoised/files");
+
+        // Paths to the noisy and denoised logs
+        n_log_path = Path::join_path(maps_path, "noisy/log");
+        d_log_path = Path::join_path(maps_path, "denoised/log");
 
-    // Calculate the environment statistics of the noisy and denoised maps
-    auto noisy_env_stats    = Denoiser::table_of_stats(original_map, r_env);
-    auto denoised_env_stats = Denoiser::table_of_stats(denoised_map, r_env);
+        // Create the needed directories, the maps are not stored when streaming
+        if (!streaming) {
+            Path::make_path(n_files_path); Path::make_path(n_log_path);
+            Path::make_path(d_files_path); Path::make_path(d_log_path);
+        }
+    }, {t_gstats});
 
-    // Generate the path where the maps will be stored
-    const auto maps_path = Path::format_str(
-        "out/data/%s/s%.4f_h%.4f_r%.4f_p%.4f",
-        protein.c_str(), sigma, denoise_param, r_env, perc_t
-    );
+    // Identifier of the task producing the denoised maps
+    int t_denoise;
 
-    // Generate the path where the log will be output
-    const auto logs_path = Path::format_str(
-       "out/log/%s/s%.4f_h%.4f_r%.4f_p%.4f",
-       protein.c_str(), sigma, denoise_param, r_env, perc_t
-    );
+    if (graph_in.empty()) {
 
-    // Create the basic directories if needed
-    Path::make_path(maps_path); 
-    Path::make_path(logs_path);
+        // Calculate the environments of the guide map
+        const int t_envs = tasks.add_task("guide_envs", [&]() {
+            envs = Denoiser::table_of_envs(guide_map, r_env);
+        });
 
-    // Paths to the noisy and denoised data
-    const auto n_files_path = Path::join_path(maps_path, "noisy/files");
-    const auto d_files_path = Path::join_path(maps_path, "denoised/files");
+        // Denoise the maps using the map denoiser
+        t_denoise = tasks.add_task("pairwise", [&]() {
 
-    // Paths to the noisy and denoised logs
-    const auto n_log_path = Path::join_path(maps_path, "noisy/log");
-    const auto d_log_path = Path::join_path(maps_path, "denoised/log");
+            // The CUDA device is set per thread
+            cudaSetDevice(device);
 
-    // Create the needed directories
-    Path::make_path(n_files_path); Path::make_path(n_log_path);
-    Path::make_path(d_files_path); Path::make_path(d_log_path);
+            if (is_approx) {
+                auto denoiser_output = Denoiser::nlmeans_approx(
+                    original_maps[0], envs, guide_env_stats(), perc_t, approx_k, approx_m
+                );
+                denoised_maps.push_back(std::get<0>(denoiser_output));
+                captured_mass = std::get<2>(denoiser_output);
+            } else if (K == 1) {
+                auto denoiser_output = Denoiser::nlmeans_denoiser(
+                    original_maps[0], envs, guide_env_stats(), perc_t, r_env, state,
+                    graph_out.empty() ? nullptr : &graph, graph_t
+                );
+                denoised_maps.push_back(std::get<0>(denoiser_output));
+            } else {
+                auto denoiser_output = Denoiser::nlmeans_joint(
+                    original_maps, envs, guide_env_stats(), perc_t
+                );
+                denoised_maps = std::get<0>(denoiser_output);
+            }
+            delete[] envs;
+        }, {t_envs, t_gstats});
+
+        // Save the graph of weights if needed
+        if (!graph_out.empty()) {
+            tasks.add_task("save_graph", [&]() { graph.save_graph(graph_out); }, {t_denoise});
+        }
+
+    } else {
+
+        // Load a graph of weights and apply it to the noisy maps
+        const int t_graph = tasks.add_task("load_graph", [&]() { graph = WeightGraph(graph_in); });
+
+        t_denoise = tasks.add_task("graph_apply", [&]() {
+            for (const auto& original_map : original_maps) {
+
+                // Apply the graph iteratively using the previous output as input
+                Map denoised_map = graph.apply(original_map, denoise_param);
+
+                for (int it = 1; it < graph_it; it++) {
+                    denoised_map = graph.apply(denoised_map, denoise_param);
+                }
+
+                denoised_maps.push_back(denoised_map);
+            }
+        }, {t_graph, t_paths});
+    }
 
-    // Save the noisy and denoised maps in memory
-    original_map.save_map(Path::join_path(n_files_path, "noisy.map"));
-    denoised_map.save_map(Path::join_path(d_files_path, "denoised.map"));
+    if (!streaming) {
 
-    // Save the statistics of the environment in memory
-    Utils::save_envstats(
-        Path::join_path(n_log_path, "envstats.dat"), 
-        noisy_env_stats, original_map
-    );
+        for (int k = 0; k < K; k++) {
 
-    // Save the average for each environment in the denoised map
-    Utils::save_envstats(
-        Path::join_path(d_log_path, "envstats.dat"), 
-        denoised_env_stats, denoised_map
-    );
+            // Save the noisy map and its statistics while the denoiser runs
+            tasks.add_task(suffixed("save_noisy_map", k, ""), [&, k]() {
+                noisy_maps[k].save_map(Path::join_path(n_files_path, suffixed("noisy", k, ".map")));
+                Perf::add_items(noisy_maps[k].get_volume());
+            }, {t_paths});
+            tasks.add_task(suffixed("save_noisy_envstats", k, ""), [&, k]() {
+                Utils::save_envstats(
+                    Path::join_path(n_log_path, suffixed("envstats", k, ".dat")), 
+                    noisy_env_stats[k], noisy_maps[k]
+                );
+                Perf::add_items(noisy_maps[k].get_volume());
+            }, {t_paths, t_nstats[k]});
+
+            // Calculate the environment statistics of the denoised map
+            const int t_dstats = tasks.add_task(suffixed("denoised_stats", k, ""), [&, k]() {
+                denoised_env_stats[k] = Denoiser::table_of_stats(denoised_maps[k], r_env);
+            }, {t_denoise});
+
+            // Save the denoised map and the average for each environment in the denoised map
+            tasks.add_task(suffixed("save_denoised_map", k, ""), [&, k]() {
+                denoised_maps[k].save_map(
+                    Path::join_path(d_files_path, suffixed("denoised", k, ".map"))
+                );
+                Perf::add_items(denoised_maps[k].get_volume());
+            }, {t_denoise, t_paths});
+            tasks.add_task(suffixed("save_denoised_envstats", k, ""), [&, k]() {
+                Utils::save_envstats(
+                    Path::join_path(d_log_path, suffixed("envstats", k, ".dat")), 
+                    denoised_env_stats[k], denoised_maps[k]
+                );
+                Perf::add_items(denoised_maps[k].get_volume());
+            }, {t_dstats, t_paths});
+        }
+
+    } else {
+
+        // Stream the noisy map as soon as it is generated
+        if (noisy_fd >= 0) {
+            tasks.add_task("stream_noisy_map", [&]() {
+                Stream::write_map(noisy_fd, noisy_maps[0]);
+                Perf::add_items(noisy_maps[0].get_volume());
+            });
+        }
+
+        // Stream the denoised map to the file, stdout or file descriptor requested
+        if (!map_out.empty() || denoised_fd >= 0) {
+            tasks.add_task("stream_denoised_map", [&]() {
+                if (map_out == "-") Stream::write_map(STDOUT_FILENO, denoised_maps[0]);
+                else if (!map_out.empty()) denoised_maps[0].save_map(map_out);
+
+                if (denoised_fd >= 0) Stream::write_map(denoised_fd, denoised_maps[0]);
+                Perf::add_items(denoised_maps[0].get_volume());
+            }, {t_denoise});
+        }
+
+        // Stream the environment averages of the denoised map
+        if (stats_fd >= 0) {
+            const int t_dstats = tasks.add_task("denoised_stats", [&]() {
+                denoised_env_stats[0] = Denoiser::table_of_stats(denoised_maps[0], r_env);
+            }, {t_denoise});
+            tasks.add_task("stream_denoised_envstats", [&]() {
+                Stream::write_envstats(stats_fd, denoised_env_stats[0], denoised_maps[0]);
+                Perf::add_items(denoised_maps[0].get_volume());
+            }, {t_dstats});
+        }
+    }
+
+    // Execute all stages on a shared pool of threads. The pairwise stage mostly
+    // waits on the GPU, so at least four workers are kept to overlap the rest
+    Tasks::ThreadPool pool(std::max<int>(std::thread::hardware_concurrency(), 4));
+    tasks.run(pool);
+
+    // Save the timings and the critical path of the run
+    std::ofstream timing_log(Path::join_path(logs_path, "timing.log"));
+    tasks.report(timing_log);
+
+    // Placement of the threads and tables used in the run
+    timing_log << "# numa: " << Numa::summary() << "\n";
+
+    // Save the hardware counters of each stage and thread
+    if (Perf::enabled()) {
+        std::ofstream perf_log(Path::join_path(logs_path, "perf.log"));
+        Perf::report(perf_log);
+    }
+
+    // Fraction of the kernel mass computed exactly by the approximate denoiser
+    if (is_approx) {
+        timing_log << "# approx: K = " << (approx_k > 0 ? std::to_string(approx_k) : "sqrt(Ne)")
+                   << ", M = " << approx_m << ", captured mass " << captured_mass << "\n";
+    }
 
-    // Output the value of h to capture it in the pipeline
-    std::cout << denoise_param << std::endl;
+    // Output the value of h to capture it in the pipeline, stdout may contain the map
+    (stdout_used ? std::cerr : std::cout) << denoise_param << std::endl;
 
 return 0;
 }
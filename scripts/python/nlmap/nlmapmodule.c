@@ -0,0 +1,339 @@
+// CPython binding of libnlmap. Arrays are exchanged through the buffer protocol,
+// so NumPy arrays are passed to the library without converting them to Python
+// objects. The library copies the input values once into its own working map.
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <nlmap.h>
+
+// -- Python object wrapping a map loaded by the library {{{
+typedef struct {
+    PyObject_HEAD
+    nlmap_map* map;
+    int shape[3];
+    Py_ssize_t buffer_shape[3];
+    Py_ssize_t buffer_strides[3];
+} MapObject;
+
+static PyTypeObject MapType;
+// -- }}}
+
+// -- Raise a Python exception containing the last library error
+static PyObject* raise_error(void)
+{
+    PyErr_SetString(PyExc_RuntimeError, nlmap_last_error());
+    return NULL;
+}
+
+// -- Number of points in the grid of a map
+static Py_ssize_t map_volume(const MapObject* self)
+{
+    return (Py_ssize_t) self->shape[0] * self->shape[1] * self->shape[2];
+}
+
+// -- Obtain a C-contiguous float32 buffer of a given number of elements {{{
+static int get_float_buffer(PyObject* obj, Py_buffer* view, Py_ssize_t size, int writable)
+{
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+    if (writable) flags |= PyBUF_WRITABLE;
+
+    if (PyObject_GetBuffer(obj, view, flags) < 0) return -1;
+
+    if (view->itemsize != sizeof(float) || view->format == NULL ||
+        (view->format[0] != 'f' && !(view->format[0] == '<' && view->format[1] == 'f'))) {
+        PyErr_SetString(PyExc_TypeError, "Buffer must contain float32 values");
+        PyBuffer_Release(view);
+        return -1;
+    }
+
+    if (view->len != size * (Py_ssize_t) sizeof(float)) {
+        PyErr_Format(PyExc_ValueError, "Buffer must contain %zd values", size);
+        PyBuffer_Release(view);
+        return -1;
+    }
+
+    return 0;
+}
+// -- }}}
+
+// -- Allocate a float32 numpy array when the caller does not provide one {{{
+static PyObject* new_float_array(const MapObject* map, int octancts)
+{
+    PyObject* numpy = PyImport_ImportModule("numpy");
+    if (numpy == NULL) return NULL;
+
+    PyObject* shape = octancts ?
+        Py_BuildValue("(iiii)", map->shape[2], map->shape[1], map->shape[0], octancts) :
+        Py_BuildValue("(iii)",  map->shape[2], map->shape[1], map->shape[0]);
+
+    PyObject* array = PyObject_CallMethod(numpy, "empty", "(Os)", shape, "float32");
+
+    Py_XDECREF(shape);
+    Py_DECREF(numpy);
+
+    return array;
+}
+// -- }}}
+
+// -- Map type {{{
+static int Map_init(MapObject* self, PyObject* args, PyObject* kwds)
+{
+    const char* path;
+    if (!PyArg_ParseTuple(args, "s", &path)) return -1;
+
+    // Arrays exported from the current grid would point to freed memory
+    if (self->map != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Map is already loaded");
+        return -1;
+    }
+
+    nlmap_map* map;
+    Py_BEGIN_ALLOW_THREADS
+    map = nlmap_map_load(path);
+    Py_END_ALLOW_THREADS
+
+    if (map == NULL) { raise_error(); return -1; }
+
+    self->map = map;
+    nlmap_map_shape(map, self->shape);
+
+    // The grid is stored with u as the fastest index: shape (Nw, Nv, Nu)
+    self->buffer_shape[0]   = self->shape[2];
+    self->buffer_shape[1]   = self->shape[1];
+    self->buffer_shape[2]   = self->shape[0];
+    self->buffer_strides[2] = sizeof(float);
+    self->buffer_strides[1] = self->shape[0] * sizeof(float);
+    self->buffer_strides[0] = self->shape[0] * self->shape[1] * sizeof(float);
+
+    return 0;
+}
+
+static void Map_dealloc(MapObject* self)
+{
+    nlmap_map_free(self->map);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+static int Map_getbuffer(MapObject* self, Py_buffer* view, int flags)
+{
+    if (self->map == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Map is not loaded");
+        return -1;
+    }
+
+    view->obj        = (PyObject*) self;
+    view->buf        = nlmap_map_data(self->map);
+    view->len        = map_volume(self) * sizeof(float);
+    view->readonly   = 0;
+    view->itemsize   = sizeof(float);
+    view->format     = (flags & PyBUF_FORMAT) ? "f" : NULL;
+    // Without PyBUF_ND the consumer expects a flat buffer of len bytes
+    view->ndim       = (flags & PyBUF_ND) ? 3 : 1;
+    view->shape      = (flags & PyBUF_ND) ? self->buffer_shape : NULL;
+    view->strides    = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->buffer_strides : NULL;
+    view->suboffsets = NULL;
+    view->internal   = NULL;
+
+    Py_INCREF(self);
+    return 0;
+}
+
+static PyBufferProcs Map_as_buffer = {
+    (getbufferproc) Map_getbuffer, NULL
+};
+
+static PyObject* Map_shape(MapObject* self, void* closure)
+{
+    return Py_BuildValue("(iii)", self->shape[2], self->shape[1], self->shape[0]);
+}
+
+static PyObject* Map_save(MapObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"path", "values", NULL};
+    const char* path; PyObject* values = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist, &path, &values))
+        return NULL;
+
+    Py_buffer view = {0}; const float* data = NULL;
+    if (values != Py_None) {
+        if (get_float_buffer(values, &view, map_volume(self), 0) < 0) return NULL;
+        data = view.buf;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = nlmap_map_save(self->map, data, path);
+    Py_END_ALLOW_THREADS
+
+    if (values != Py_None) PyBuffer_Release(&view);
+    if (status < 0) return raise_error();
+
+    Py_RETURN_NONE;
+}
+
+static PyGetSetDef Map_getset[] = {
+    {"shape", (getter) Map_shape, NULL, "Shape of the grid (Nw, Nv, Nu)", NULL},
+    {NULL}
+};
+
+static PyMethodDef Map_methods[] = {
+    {"save", (PyCFunction) Map_save, METH_VARARGS | METH_KEYWORDS,
+     "save(path, values=None): save the values on the grid of the map"},
+    {NULL}
+};
+// -- }}}
+
+// -- Run one of the table functions of the library {{{
+typedef int (*table_func)(const nlmap_map*, const float*, float, float*);
+
+static PyObject* run_table(PyObject* args, PyObject* kwds, table_func func, int octancts)
+{
+    static char* kwlist[] = {"map", "r_env", "values", "out", NULL};
+    MapObject* map; float r_env; PyObject* values = Py_None; PyObject* out = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!f|OO", kwlist,
+            &MapType, &map, &r_env, &values, &out))
+        return NULL;
+
+    const Py_ssize_t Ne = map_volume(map);
+
+    // Allocate the output array if needed, otherwise keep a reference to return it
+    if (out == Py_None) {
+        if ((out = new_float_array(map, octancts)) == NULL) return NULL;
+    } else {
+        Py_INCREF(out);
+    }
+
+    Py_buffer v_view = {0}, o_view = {0}; const float* data = NULL;
+
+    if (values != Py_None) {
+        if (get_float_buffer(values, &v_view, Ne, 0) < 0) { Py_DECREF(out); return NULL; }
+        data = v_view.buf;
+    }
+
+    if (get_float_buffer(out, &o_view, Ne * (octancts ? octancts : 1), 1) < 0) {
+        if (values != Py_None) PyBuffer_Release(&v_view);
+        Py_DECREF(out); return NULL;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = func(map->map, data, r_env, o_view.buf);
+    Py_END_ALLOW_THREADS
+
+    if (values != Py_None) PyBuffer_Release(&v_view);
+    PyBuffer_Release(&o_view);
+
+    if (status < 0) { Py_DECREF(out); return raise_error(); }
+
+    return out;
+}
+// -- }}}
+
+// -- Module level functions {{{
+static PyObject* py_envs(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    return run_table(args, kwds, nlmap_envs, 8);
+}
+
+static PyObject* py_stats(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    return run_table(args, kwds, nlmap_stats, 0);
+}
+
+static PyObject* py_denoise(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static char* kwlist[] = {"map", "p_thresh", "r_env", "values", "out", NULL};
+    MapObject* map; float p_thresh, r_env;
+    PyObject* values = Py_None; PyObject* out = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!ff|OO", kwlist,
+            &MapType, &map, &p_thresh, &r_env, &values, &out))
+        return NULL;
+
+    const Py_ssize_t Ne = map_volume(map);
+
+    if (out == Py_None) {
+        if ((out = new_float_array(map, 0)) == NULL) return NULL;
+    } else {
+        Py_INCREF(out);
+    }
+
+    Py_buffer v_view = {0}, o_view = {0}; const float* data = NULL;
+
+    if (values != Py_None) {
+        if (get_float_buffer(values, &v_view, Ne, 0) < 0) { Py_DECREF(out); return NULL; }
+        data = v_view.buf;
+    }
+
+    if (get_float_buffer(out, &o_view, Ne, 1) < 0) {
+        if (values != Py_None) PyBuffer_Release(&v_view);
+        Py_DECREF(out); return NULL;
+    }
+
+    int status; float hd = 0.0f;
+    Py_BEGIN_ALLOW_THREADS
+    status = nlmap_denoise(map->map, data, p_thresh, r_env, o_view.buf, &hd);
+    Py_END_ALLOW_THREADS
+
+    if (values != Py_None) PyBuffer_Release(&v_view);
+    PyBuffer_Release(&o_view);
+
+    if (status < 0) { Py_DECREF(out); return raise_error(); }
+
+    return Py_BuildValue("(Nf)", out, hd);
+}
+
+static PyObject* py_set_device(PyObject* self, PyObject* args)
+{
+    int device;
+    if (!PyArg_ParseTuple(args, "i", &device)) return NULL;
+    if (nlmap_set_device(device) < 0) return raise_error();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef nlmap_methods[] = {
+    {"envs", (PyCFunction) py_envs, METH_VARARGS | METH_KEYWORDS,
+     "envs(map, r_env, values=None, out=None): table of environments (Nw, Nv, Nu, 8)"},
+    {"stats", (PyCFunction) py_stats, METH_VARARGS | METH_KEYWORDS,
+     "stats(map, r_env, values=None, out=None): table of environment averages"},
+    {"denoise", (PyCFunction) py_denoise, METH_VARARGS | METH_KEYWORDS,
+     "denoise(map, p_thresh, r_env, values=None, out=None): (denoised, hd)"},
+    {"set_device", py_set_device, METH_VARARGS,
+     "set_device(device): GPU used by the denoiser in the calling thread"},
+    {NULL}
+};
+// -- }}}
+
+static struct PyModuleDef nlmap_module = {
+    PyModuleDef_HEAD_INIT, "nlmap", "In-process access to the nlmap denoiser.", -1,
+    nlmap_methods
+};
+
+PyMODINIT_FUNC PyInit_nlmap(void)
+{
+    MapType.tp_name      = "nlmap.Map";
+    MapType.tp_doc       = "Map(path): CCP4 map exposing its grid through the buffer protocol";
+    MapType.tp_basicsize = sizeof(MapObject);
+    MapType.tp_flags     = Py_TPFLAGS_DEFAULT;
+    MapType.tp_new       = PyType_GenericNew;
+    MapType.tp_init      = (initproc) Map_init;
+    MapType.tp_dealloc   = (destructor) Map_dealloc;
+    MapType.tp_as_buffer = &Map_as_buffer;
+    MapType.tp_getset    = Map_getset;
+    MapType.tp_methods   = Map_methods;
+
+    if (PyType_Ready(&MapType) < 0) return NULL;
+
+    PyObject* module = PyModule_Create(&nlmap_module);
+    if (module == NULL) return NULL;
+
+    Py_INCREF(&MapType);
+    if (PyModule_AddObject(module, "Map", (PyObject*) &MapType) < 0) {
+        Py_DECREF(&MapType); Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
+}
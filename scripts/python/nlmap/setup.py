@@ -0,0 +1,18 @@
+#!/bin/python3
+''' Build the nlmap extension against libnlmap.so, created using make lib. '''
+import os
+from setuptools import setup, Extension
+
+# Root of the repository, where libnlmap.so and the include folder are located
+BASE_PATH = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', '..', '..'))
+
+nlmap = Extension(
+    'nlmap',
+    sources=['nlmapmodule.c'],
+    include_dirs=[os.path.join(BASE_PATH, 'include')],
+    library_dirs=[BASE_PATH],
+    runtime_library_dirs=[BASE_PATH],
+    libraries=['nlmap'],
+)
+
+setup(name='nlmap', version='0.1', ext_modules=[nlmap])
@@ -20,15 +20,15 @@ void Map::normalise()
 
 #include <iostream>
 
-float Map::add_noise(const float& sigma, const bool& normalise)
+float Map::add_noise(const float& sigma, const bool& normalise, const unsigned int& seed)
 {
     // Add gaussian noise with std sigma to the whole map
     
     // If the sigma value is zero, do not add any noise
     if (sigma == 0) return sigma;
 
-    // Instantiate a random engine
-    std::default_random_engine engine;
+    // Instantiate a random engine, maps using different seeds get independent noise
+    std::default_random_engine engine(seed);
     std::normal_distribution<float> normal(0.0, sigma);
 
     // Add some random noise to each point in the grid
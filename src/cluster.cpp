@@ -0,0 +1,203 @@
+#include <cluster.hpp>
+
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+// User defined modules
+#include <taskgraph.hpp>
+#include <numa.hpp>
+
+// -- Squared euclidean distance between two descriptors
+static inline float distance_sq(const float* a, const float* b)
+{
+    float dsq = 0.0f;
+
+    for (int o = 0; o < Octanct::No; o++) {
+        dsq += (a[o] - b[o]) * (a[o] - b[o]);
+    }
+
+    return dsq;
+}
+
+// -- Index of the nearest centroid to a descriptor
+static inline int nearest_centroid(const float* desc, const vector<float>& centroids, const int& K)
+{
+    int best = 0; float best_dsq = distance_sq(desc, &centroids[0]);
+
+    for (int c = 1; c < K; c++) {
+        const float dsq = distance_sq(desc, &centroids[c * Octanct::No]);
+        if (dsq < best_dsq) { best = c; best_dsq = dsq; }
+    }
+
+    return best;
+}
+
+// -- Environments rotated to a canonical orientation {{{
+float* Cluster::canonical_envs(const float* envs, const int& Ne)
+{
+    // -- The denoiser compares environments using the minimum distance over all
+    // -- rotations. Before clustering, each environment is rotated such that the
+    // -- largest octanct averages are placed at the lowest octancts, which is
+    // -- obtained maximising the key sum_o (No - o) * env[rot[o]].
+    const int& No = Octanct::No;
+    const int& Nr = Octanct::Nr;
+
+    // Table containing the rotated indices for each needed rotation
+    const octanct* rots = Octanct::table_of_rotations();
+
+    // The descriptors are allocated uninitialised, so each chunk is first touched
+    // by the thread, and node, processing it
+    float* descs = new float[Ne * No];
+
+    // Copy of the table of rotations on each node if replication is enabled
+    const Numa::Replicated<octanct> rots_rep(rots, Nr * No);
+
+    Tasks::parallel_for(Ne, [&](int begin, int end) {
+
+        const octanct* l_rots = rots_rep.local();
+
+        for (int e = begin; e < end; e++) {
+
+            // Rotation with the largest key
+            int best = 0; float best_key = 0.0f;
+
+            for (int r = 0; r < Nr; r++) {
+
+                float key = 0.0f;
+                for (int o = 0; o < No; o++) key += (No - o) * envs[e * No + l_rots[r * No + o]];
+
+                if (r == 0 || key > best_key) { best = r; best_key = key; }
+            }
+
+            for (int o = 0; o < No; o++) descs[e * No + o] = envs[e * No + l_rots[best * No + o]];
+        }
+    });
+
+    delete[] rots;
+
+    return descs;
+}
+// -- }}}
+
+// -- Parallel mini-batch k-means on the environment descriptors {{{
+Cluster::Clusters Cluster::minibatch_kmeans(
+    const float* descs, const int& Ne, const int& num_clusters,
+    const int& batch, const int& iters
+) {
+    // -- Mini-batch k-means (Sculley, 2010). Centroids are initialised using
+    // -- random descriptors and updated using random batches of descriptors with
+    // -- a learning rate of 1 / (number of descriptors assigned to the centroid).
+    // -- The assignment steps are computed in parallel.
+    const int& No = Octanct::No;
+
+    Clusters clusters;
+    clusters.K = std::max(1, std::min(num_clusters, Ne));
+
+    const int& K = clusters.K;
+
+    // Use a fixed seed so runs are reproducible
+    std::mt19937 engine(0);
+
+    // Initialise the centroids using K distinct random descriptors
+    vector<int> indices(Ne);
+    std::iota(indices.begin(), indices.end(), 0);
+
+    for (int c = 0; c < K; c++) {
+        std::swap(indices[c], indices[std::uniform_int_distribution<int>(c, Ne - 1)(engine)]);
+    }
+
+    clusters.centroids.resize(K * No);
+    for (int c = 0; c < K; c++) {
+        std::copy(&descs[indices[c] * No], &descs[indices[c] * No] + No, &clusters.centroids[c * No]);
+    }
+
+    // The batches read random descriptors, so each node may use its own copy
+    const Numa::Replicated<float> descs_rep(descs, Ne * No);
+
+    // Number of descriptors used to update each centroid
+    vector<int> seen(K, 0);
+
+    // Descriptors in the batch and their nearest centroid
+    vector<int> samples(batch), assigned(batch);
+    std::uniform_int_distribution<int> uniform(0, Ne - 1);
+
+    for (int it = 0; it < iters; it++) {
+
+        for (auto& s : samples) s = uniform(engine);
+
+        // Assign each descriptor of the batch to its nearest centroid
+        Tasks::parallel_for(batch, [&](int begin, int end) {
+
+            const float* l_descs = descs_rep.local();
+
+            for (int b = begin; b < end; b++) {
+                assigned[b] = nearest_centroid(&l_descs[samples[b] * No], clusters.centroids, K);
+            }
+        });
+
+        // Move the centroids towards the descriptors assigned to them
+        for (int b = 0; b < batch; b++) {
+
+            const int& c = assigned[b];
+            const float eta = 1.0f / ++seen[c];
+
+            for (int o = 0; o < No; o++) {
+                clusters.centroids[c * No + o] += eta *
+                    (descs[samples[b] * No + o] - clusters.centroids[c * No + o]);
+            }
+        }
+    }
+
+    // Assign all descriptors to their nearest centroid
+    clusters.labels.resize(Ne);
+    Numa::release_pages(clusters.labels.data(), Ne * sizeof(int));
+
+    Tasks::parallel_for(Ne, [&](int begin, int end) {
+        for (int e = begin; e < end; e++) {
+            clusters.labels[e] = nearest_centroid(&descs[e * No], clusters.centroids, K);
+        }
+    });
+
+    // Count the number of descriptors in each cluster
+    clusters.counts.assign(K, 0);
+    for (const int& l : clusters.labels) clusters.counts[l]++;
+
+    return clusters;
+}
+// -- }}}
+
+// -- Table containing the M nearest clusters to each cluster {{{
+vector<int> Cluster::nearest_clusters(const Clusters& clusters, const int& M)
+{
+    const int& K  = clusters.K;
+    const int& No = Octanct::No;
+
+    // Number of neighbouring clusters, each cluster is its own first neighbour
+    const int Nm = std::min(M, K);
+
+    vector<int> table(K * Nm);
+
+    Tasks::parallel_for(K, [&](int begin, int end) {
+
+        // Order of the clusters by distance to the current one
+        vector<int> order(K);
+
+        for (int c = begin; c < end; c++) {
+
+            std::iota(order.begin(), order.end(), 0);
+            std::partial_sort(order.begin(), order.begin() + Nm, order.end(),
+                [&](const int& a, const int& b) {
+                    if (a == c || b == c) return a == c && b != c;
+                    return distance_sq(&clusters.centroids[c * No], &clusters.centroids[a * No]) <
+                           distance_sq(&clusters.centroids[c * No], &clusters.centroids[b * No]);
+                }
+            );
+
+            std::copy(order.begin(), order.begin() + Nm, table.begin() + c * Nm);
+        }
+    });
+
+    return table;
+}
+// -- }}}
@@ -24,6 +24,22 @@ int __get_idc(const int& b, const int& t, const int& Nr, const int& No)
     return b * 2 + (t >= Nr * No);
 }
 
+__forceinline__ __device__
+float __row_min(const float* d_squared, const int& idc, const int& Nr)
+{
+    // -- Minimum distance squared over all rotations of the row idc
+    float min_dsq = d_squared[idc * Nr + 0];
+
+    // Update the minimum value if needed
+    for (int r = 1; r < Nr; r++) {
+        if (min_dsq > d_squared[idc * Nr + r]) {
+            min_dsq = d_squared[idc * Nr + r];
+        }
+    }
+
+    return min_dsq;
+}
+
 __global__
 void Cudenoiser::calculate_dsq(
     float* dsq, float* envs, const octanct* rots, const int er, 
@@ -83,18 +99,8 @@ void Cudenoiser::update_denoiser(
     // Check if the current thread is inside the bounds
     if (gidx < (Ne - er)) {
 
-        // Generate a temporary variable to find the minimum distance squared
-        float min_dsq = d_squared[gidx * Nr + 0];
-
-        // Update the minimum value if needed
-        for (int r = 1; r < Nr; r++) {
-            if (min_dsq > d_squared[gidx * Nr + r]) {
-                min_dsq = d_squared[gidx * Nr + r];
-            }
-        }
-
         // Compute the kernel using the minimum distance
-        float kernel = expf(- min_dsq * inv_den);
+        float kernel = expf(- __row_min(d_squared, gidx, Nr) * inv_den);
 
         // Update the denoised map in the correct locations
         atomicAdd(dmap + gidx + er, kernel * omap[er]);
@@ -105,3 +111,224 @@ void Cudenoiser::update_denoiser(
         atomicAdd(kernels + er,        kernel);
     }
 }
+
+__global__
+void Cudenoiser::update_joint(
+    float* dmaps, float* kernels, float* d_squared, float* omaps,
+    const int er, const int Ne, const int Nr, const int K, const float inv_den
+) {
+    // -- Same as update_denoiser for K maps on the same grid sharing the kernels.
+    // -- The maps are interleaved, the value of the map k at the point e is 
+    // -- stored at e * K + k, so each thread updates K contiguous values.
+
+    // Get the global index of the current thread -- Corresponds to idc
+    const int gidx = blockIdx.x * blockDim.x + threadIdx.x;
+
+    // Check if the current thread is inside the bounds
+    if (gidx < (Ne - er)) {
+
+        // Compute the kernel using the minimum distance
+        const float kernel = expf(- __row_min(d_squared, gidx, Nr) * inv_den);
+
+        // Comparison environment of the current thread
+        const int ec = gidx + er;
+
+        // Update all denoised maps in the correct locations
+        for (int k = 0; k < K; k++) {
+            atomicAdd(dmaps + ec * K + k, kernel * omaps[er * K + k]);
+            atomicAdd(dmaps + er * K + k, kernel * omaps[ec * K + k]);
+        }
+
+        // Add the kernels to the correct locations
+        atomicAdd(kernels + ec, kernel);
+        atomicAdd(kernels + er, kernel);
+    }
+}
+
+__global__
+void Cudenoiser::collect_weights(
+    int* rows, int* cols, float* weights, int* count, const int capacity, float* d_squared,
+    const int er, const int Ne, const int Nr, const float inv_den, const float w_thresh
+) {
+    // -- Store the kernels of the comparisons (er, ec = [er, Ne]) that are larger
+    // -- than w_thresh. The pair and the kernel are appended to rows, cols and 
+    // -- weights using count as the position of the next free slot. count is not
+    // -- reset between references, so the weights of a batch of references are
+    // -- copied at once. Slots beyond capacity are counted but not stored.
+
+    // Get the global index of the current thread -- Corresponds to idc
+    const int gidx = blockIdx.x * blockDim.x + threadIdx.x;
+
+    // Check if the current thread is inside the bounds
+    if (gidx < (Ne - er)) {
+
+        // Compute the kernel using the minimum distance
+        const float kernel = expf(- __row_min(d_squared, gidx, Nr) * inv_den);
+
+        if (kernel > w_thresh) {
+            const int slot = atomicAdd(count, 1);
+            if (slot < capacity) {
+                rows[slot]    = er;
+                cols[slot]    = gidx + er;
+                weights[slot] = kernel;
+            }
+        }
+    }
+}
+
+__device__
+float __min_dsq(
+    const float* env_r, const float* env_c, const octanct* rots, const int Nr, const int No
+) {
+    // -- Minimum distance squared over all rotations of the reference environment
+    // -- env_r when compared to the environment env_c. Same value as the one 
+    // -- obtained by the combination of calculate_dsq and update_denoiser.
+    float min_dsq = 0.0f;
+
+    for (int r = 0; r < Nr; r++) {
+
+        // Distance squared for the current rotation
+        float dsq = 0.0f;
+
+        for (int o = 0; o < No; o++) {
+            const float diff = env_r[rots[r * No + o]] - env_c[o];
+            dsq += (diff * diff) / No;
+        }
+
+        // Update the minimum value if needed
+        if (r == 0 || min_dsq > dsq) min_dsq = dsq;
+    }
+
+    return min_dsq;
+}
+
+__global__
+void Cudenoiser::update_pairs(
+    float* dmap, float* kernels, const float* o_envs, const float* n_envs,
+    const float* o_omap, const float* n_omap, const octanct* rots, 
+    const unsigned char* affected, const int ea, const int Ne, const int Nr, 
+    const int No, const float inv_den
+) {
+    // -- Replace the contribution of the pairs (ea, ec) for ec = [0, Ne] to the 
+    // -- denoised map and the sum of kernels. The old contribution is computed 
+    // -- from the old environments and map values and subtracted, while the new
+    // -- contribution is added. Pairs where both environments are affected are 
+    // -- only updated once, when ea is the smallest index of the pair.
+
+    // Get the global index of the current thread -- Corresponds to ec
+    const int ec = blockIdx.x * blockDim.x + threadIdx.x;
+
+    // Check if the current thread is inside the bounds and it is not a repeated pair
+    if (ec < Ne && (!affected[ec] || ec >= ea)) {
+
+        // The reference environment is always the smallest index as in the full run
+        const int er = (ea < ec) ? ea : ec;
+        const int ep = (ea < ec) ? ec : ea;
+
+        // Old and new kernels of the pair
+        const float o_kernel = expf(- __min_dsq(o_envs + er * No, o_envs + ep * No, rots, Nr, No) * inv_den);
+        const float n_kernel = expf(- __min_dsq(n_envs + er * No, n_envs + ep * No, rots, Nr, No) * inv_den);
+
+        // Replace the contributions to the denoised map
+        atomicAdd(dmap + ea, n_kernel * n_omap[ec] - o_kernel * o_omap[ec]);
+        atomicAdd(dmap + ec, n_kernel * n_omap[ea] - o_kernel * o_omap[ea]);
+
+        // Replace the contributions to the sum of kernels
+        atomicAdd(kernels + ea, n_kernel - o_kernel);
+        atomicAdd(kernels + ec, n_kernel - o_kernel);
+    }
+}
+
+__global__
+void Cudenoiser::approx_denoiser(
+    float* dmap, float* kernels, float* exact_mass, const float* envs, const float* omap,
+    const int* labels, const int* c_start, const int* nbrs, const float* centroids, 
+    const float* c_sum, const int* c_count, const octanct* rots, const int Ne, 
+    const int K, const int M, const int Nr, const int No, const float inv_den
+) {
+    // -- Approximate non-local means using clusters of environments. Environments
+    // -- are sorted by cluster, so the members of the cluster c are located in 
+    // -- [c_start[c], c_start[c + 1]). Each thread computes the exact kernels of 
+    // -- one environment against all members of its M nearest clusters (nbrs),
+    // -- including its own. The rest of clusters contribute through their centroid,
+    // -- kernel(env, centroid) * (sum of values, number of members) of the cluster.
+
+    // Get the global index of the current thread -- Corresponds to the environment
+    const int e = blockIdx.x * blockDim.x + threadIdx.x;
+
+    if (e < Ne) {
+
+        // Cluster of the current environment
+        const int c = labels[e];
+
+        // Accumulators of the denoised value and the sum of kernels
+        float sum_val = 0.0f, sum_ker = 0.0f;
+
+        // Exact contributions of the neighbouring clusters
+        for (int m = 0; m < M; m++) {
+
+            const int cn = nbrs[c * M + m];
+
+            for (int ec = c_start[cn]; ec < c_start[cn + 1]; ec++) {
+                const float kernel = expf(- __min_dsq(envs + e * No, envs + ec * No, rots, Nr, No) * inv_den);
+                sum_val += kernel * omap[ec];
+                sum_ker += kernel;
+            }
+        }
+
+        // The exhaustive denoiser adds the self contribution twice
+        sum_val += omap[e];
+        sum_ker += 1.0f;
+
+        exact_mass[e] = sum_ker;
+
+        // Centroid based contributions of the rest of clusters
+        for (int cf = 0; cf < K; cf++) {
+
+            // Check if the cluster is one of the neighbours
+            bool is_neighbour = false;
+            for (int m = 0; m < M; m++) is_neighbour |= (nbrs[c * M + m] == cf);
+
+            if (is_neighbour || c_count[cf] == 0) continue;
+
+            const float kernel = expf(- __min_dsq(envs + e * No, centroids + cf * No, rots, Nr, No) * inv_den);
+            sum_val += kernel * c_sum[cf];
+            sum_ker += kernel * c_count[cf];
+        }
+
+        dmap[e]    = sum_val;
+        kernels[e] = sum_ker;
+    }
+}
+
+__global__
+void Cudenoiser::exhaustive_mass(
+    float* mass, const int* samples, const float* envs, const octanct* rots,
+    const int S, const int Ne, const int Nr, const int No, const float inv_den
+) {
+    // -- Sum of all kernels of the sampled environments computed exhaustively,
+    // -- used to measure the weight mass captured by the approximate denoiser.
+    // -- The grid contains the same number of blocks for each sample. The threads
+    // -- of the blocks of a sample split its columns, and each one adds its partial
+    // -- sum to mass, which must be set to zero before the launch.
+
+    // Number of blocks per sample, sample and column of the current thread
+    const int Bc = gridDim.x / S;
+    const int s  = blockIdx.x / Bc;
+    const int c  = (blockIdx.x % Bc) * blockDim.x + threadIdx.x;
+
+    if (s < S) {
+
+        // Sampled environment of the current thread
+        const int e = samples[s];
+
+        // The exhaustive denoiser adds the self contribution twice
+        float sum_ker = (c == 0) ? 1.0f : 0.0f;
+
+        for (int ec = c; ec < Ne; ec += Bc * blockDim.x) {
+            sum_ker += expf(- __min_dsq(envs + e * No, envs + ec * No, rots, Nr, No) * inv_den);
+        }
+
+        atomicAdd(mass + s, sum_ker);
+    }
+}
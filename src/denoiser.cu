@@ -1,5 +1,9 @@
 #include <denoiser.hpp>
 #include <iomanip>
+#include <stdexcept>
+#include <numeric>
+#include <algorithm>
+#include <climits>
 
 // -- Inline function to get all octancts in a vector
 __host__
@@ -87,6 +91,56 @@ vector<float>* Denoiser::get_octs(
 }
 // -- }}}
 
+// -- Octanct averages of the environment around a given grid point {{{
+__host__
+inline void env_of_point(
+    float* env, const Map& map, const int& u, const int& v, const int& w, 
+    const vector<grid_point>& indices
+) {
+    // Get all points in each octanct
+    const vector<float>* oct_points = Denoiser::get_octs(map, u, v, w, indices);
+
+    // Iterate for each octanct to calculate its average value
+    for (int o = 0; o < Octanct::No; o++) {
+
+        // Sum of all points in the current octanct
+        const float oct_sum = std::accumulate(
+            oct_points[o].begin(), oct_points[o].end(), 0.0f
+        );
+
+        // Copy the octanct average to the correct environment
+        env[o] = oct_sum / oct_points[o].size();
+    }
+
+    // Delete the heap allocated data
+    delete[] oct_points;
+}
+// -- }}}
+
+// -- Average of the environment around a given grid point {{{
+__host__
+inline float avg_of_point(
+    const Map& map, const int& u, const int& v, const int& w, 
+    const vector<grid_point>& indices
+) {
+    // Get all points in each octanct
+    const vector<float>* oct_points = Denoiser::get_octs(map, u, v, w, indices);
+
+    // Temporary that will contain the avg of the environment
+    float env_avg = 0.0f;
+
+    // Add the sum of all points in each octanct to the environment average
+    for (int o = 0; o < Octanct::No; o++) {
+        env_avg += std::accumulate(oct_points[o].begin(), oct_points[o].end(), 0.0f);
+    }
+
+    // Delete the heap allocated data
+    delete[] oct_points;
+
+    return env_avg / indices.size();
+}
+// -- }}}
+
 // -- Get the average points per octanct {{{
 __host__
 int Denoiser::avg_points_per_octanct(Map& map, const float& r_env)
@@ -148,6 +202,21 @@ int Denoiser::avg_points_per_octanct(Map& map, const float& r_env)
 // -- Table containing the environment data, its average and standard deviation {{{
 __host__
 float* Denoiser::table_of_envs(Map& map, const float& r_env)
+{
+    // Allocate memory for all octancts in the grid
+    float* envs = new float[map.get_volume() * Octanct::No];
+
+    // The pages are placed on the node of the first thread touching them
+    Numa::advise_huge_pages(envs, map.get_volume() * Octanct::No * sizeof(float));
+
+    table_of_envs(map, r_env, envs);
+
+    // Return the table of environments
+    return envs;
+}
+
+__host__
+void Denoiser::table_of_envs(Map& map, const float& r_env, float* envs)
 {
     // First, obtain a table of near indices
     const auto indices = table_of_indices(map, r_env);
@@ -156,52 +225,45 @@ float* Denoiser::table_of_envs(Map& map, const float& r_env)
     const int& Ne = map.get_volume();
     const int& No = Octanct::No;
 
-    // Allocate memory for all octancts in the grid
-    float* envs = new float[Ne * No];
-
-    // Count the corresponding environment for each point
-    int eidx = 0;
-
-    // iterate for each point in the grid to obtain its environment
-    for (int w = 0; w < map.Nw; w++) {
-        for (int v = 0; v < map.Nv; v++) {
-            for (int u = 0; u < map.Nu; u++) {
+    // Compute the environments in parallel, so each chunk is first touched by
+    // the thread, and node, processing it
+    Tasks::parallel_for(Ne, [&](int begin, int end) {
+        for (int eidx = begin; eidx < end; eidx++) {
 
-                // Get all points in each octanct
-                const vector<float>* oct_points = get_octs(map, u, v, w, indices);
+            // Coordinates of the current point in the grid
+            const int u = eidx % map.Nu;
+            const int v = (eidx / map.Nu) % map.Nv;
+            const int w = eidx / (map.Nu * map.Nv);
 
-                // Vector containing the sum of all points in each octanct
-                float oct_sum[Octanct::No];
-
-                // Iterate for each octanct to calculate its average value
-                for (int o = 0; o < Octanct::No; o++) {
+            // Compute the octanct averages of the current environment
+            env_of_point(envs + eidx * No, map, u, v, w, indices);
+        }
 
-                    // Sum of all points in the current octanct
-                    oct_sum[o] = std::accumulate(
-                        oct_points[o].begin(), oct_points[o].end(), 0.0f
-                    );
+        Perf::add_items(end - begin);
+    });
+}
+// -- }}}
 
-                    // Copy the octanct average to the correct environment
-                    envs[eidx * No + o] = oct_sum[o] / oct_points[o].size();
-                }
+// -- Table containing environment averages {{{
+__host__
+vector<float> Denoiser::table_of_stats(Map& map, const float& r_env)
+{
+    // Number of rows and columns in the array
+    const int Ne = map.get_volume();
 
-                // Move to the next environment in the grid
-                eidx++;
+    // Allocate memory for all points in the grid. The pages zero filled by the
+    // calling thread are released, so each chunk is first touched by its thread
+    vector<float> env_stats(Ne);
+    Numa::release_pages(env_stats.data(), Ne * sizeof(float));
 
-                // Delete the heap allocated data
-                delete[] oct_points;
-            }
-        }
-    }
+    table_of_stats(map, r_env, env_stats.data());
 
     // Return the table of environments
-    return envs;
+    return env_stats;
 }
-// -- }}}
 
-// -- Table containing environment averages {{{
 __host__
-vector<float> Denoiser::table_of_stats(Map& map, const float& r_env)
+void Denoiser::table_of_stats(Map& map, const float& r_env, float* env_stats)
 {
     // First, obtain a table of near indices
     const auto indices = table_of_indices(map, r_env);
@@ -209,59 +271,64 @@ vector<float> Denoiser::table_of_stats(Map& map, const float& r_env)
     // Number of rows and columns in the array
     const int Ne = map.get_volume();
 
-    // Allocate memory for all octancts in the grid
-    vector<float> env_stats(Ne);
-
-    // Count the corresponding environment for each point
-    int eidx = 0;
-
-    // iterate for each point in the grid to obtain its environment
-    for (int w = 0; w < map.Nw; w++) {
-        for (int v = 0; v < map.Nv; v++) {
-            for (int u = 0; u < map.Nu; u++) {
+    // iterate in parallel for each point in the grid to obtain its environment
+    Tasks::parallel_for(Ne, [&](int begin, int end) {
+        for (int eidx = begin; eidx < end; eidx++) {
 
-                // Get all points in each octanct
-                const vector<float>* oct_points = get_octs(map, u, v, w, indices);
+            // Coordinates of the current point in the grid
+            const int u = eidx % map.Nu;
+            const int v = (eidx / map.Nu) % map.Nv;
+            const int w = eidx / (map.Nu * map.Nv);
 
-                // Vector containing the sum of all points in each octanct
-                float oct_sum[Octanct::No];
+            // Calculate the average of the environment
+            env_stats[eidx] = avg_of_point(map, u, v, w, indices);
+        }
 
-                // Temporary that will contain the avg of the environment
-                float env_avg = 0.0f;
+        Perf::add_items(end - begin);
+    });
+}
 
-                // Iterate for each octanct to calculate its average value
-                for (int o = 0; o < Octanct::No; o++) {
+// -- Main algorithm to denoise a map using non-local means {{{
+__host__
+std::tuple<Map, float> Denoiser::nlmeans_denoiser(
+    Map& map, const float& p_thresh, const float& r_env
+) {
+    // State of the run, discarded after denoising
+    DenoiserState state;
 
-                    // Sum of all points in the current octanct
-                    oct_sum[o] = std::accumulate(
-                        oct_points[o].begin(), oct_points[o].end(), 0.0f
-                    );
+    return nlmeans_denoiser(map, p_thresh, r_env, state);
+}
 
-                    // Add the value to the environment average
-                    env_avg += oct_sum[o];
-                }
+__host__
+std::tuple<Map, float> Denoiser::nlmeans_denoiser(
+    Map& map, const float& p_thresh, const float& r_env, DenoiserState& state
+) {
+    // Block of memory containing all environments and their averages
+    const float* envs = table_of_envs(map, r_env);
 
-                // Calculate the average of the environment
-                env_stats[eidx] = env_avg / indices.size();
+    // Get all average environments of the map using envs -- std::vector
+    const auto env_avg = table_of_stats(map, r_env);
 
-                // Move to the next environment in the grid
-                eidx++;
+    // Denoise the map using the precomputed tables
+    auto denoiser_output = nlmeans_denoiser(map, envs, env_avg, p_thresh, r_env, state);
 
-                // Delete the heap allocated data
-                delete[] oct_points;
-            }
-        }
-    }
+    // Delete the heap allocated data
+    delete[] envs;
 
-    // Return the table of environments
-    return env_stats;
+    return denoiser_output;
 }
 
-// -- Main algorithm to denoise a map using non-local means {{{
 __host__
 std::tuple<Map, float> Denoiser::nlmeans_denoiser(
-    Map& map, const float& p_thresh, const float& r_env
+    Map& map, const float* envs, const vector<float>& env_avg, 
+    const float& p_thresh, const float& r_env, DenoiserState& state,
+    WeightGraph* graph, const float& w_thresh
 ) {
+    // -- Pairwise stage of the denoiser. The table of environments and the table
+    // -- of environment averages of map are computed by the caller, so they can
+    // -- be obtained concurrently with other stages. If graph is not null, all 
+    // -- kernels larger than w_thresh are stored in it.
+
     // Construct some needed aliases
     const int& Ne = map.get_volume(); // -- Number of environments (points) in the map
     const int& No = Octanct::No;      // -- Number of octancts in an env (8)
@@ -274,21 +341,11 @@ std::tuple<Map, float> Denoiser::nlmeans_denoiser(
     float* denoised_M = denoised_map.data();
     float* original_M = map.data();
 
-    // Block of memory containing all environments and their averages
-    const float* envs = table_of_envs(map, r_env);
-
     // Table containing the rotated indices for each needed rotation
     const octanct* rots = Octanct::table_of_rotations();
 
-    // Get all average environments of the map using envs -- std::vector
-    const auto env_avg = table_of_stats(map, r_env);
-
-    // Get the maximum and minimum environment average
-    const auto min = std::min_element(env_avg.begin(), env_avg.end());
-    const auto max = std::max_element(env_avg.begin(), env_avg.end());
-
     // Calculate the denoising parameter using the threshold provided
-    const float hd      = 0.5 * p_thresh * (*max - *min);
+    const float hd      = denoising_parameter(env_avg, p_thresh);
     const float inv_den = 1 / (2 * hd * hd);
 
     // Generate the device copies of the relevant objects
@@ -312,29 +369,120 @@ std::tuple<Map, float> Denoiser::nlmeans_denoiser(
     cudaMemset(d_dmap, 0.0f, Ne * sizeof(float));
     cudaMemset(d_sumk, 0.0f, Ne * sizeof(float));
 
-    // Iterate through all reference environments in the map
-    for (int er = 0; er < Ne; er++) {
+    // -- Device buffers and host triplets used to collect the weights above w_thresh.
+    // -- The weights of a batch of references are copied to the host at once. If
+    // -- a batch does not fit in the buffers, they grow and the batch is collected
+    // -- again, so the buffers only grow a few times.
+    const int batch = std::max(1, std::min(256, INT_MAX / Ne));
+    int capacity = Ne;
+
+    int* d_rows = nullptr; int* d_cols = nullptr; float* d_wgts = nullptr; int* d_count = nullptr;
+    vector<int> g_rows, g_cols; vector<float> g_wgts;
+
+    if (graph != nullptr) {
+        cudaMalloc(&d_rows,  capacity * sizeof(int));   // -- Rows of the stored weights
+        cudaMalloc(&d_cols,  capacity * sizeof(int));   // -- Columns of the stored weights
+        cudaMalloc(&d_wgts,  capacity * sizeof(float)); // -- Stored weights
+        cudaMalloc(&d_count, sizeof(int));              // -- Number of stored weights
+        cudaMemset(d_count, 0, sizeof(int));
+    }
+
+    // Calculate all distances squared of a reference environment
+    const auto distances = [&](const int& er) {
 
         // Generate the geometry of the blocks to compute the distance squared
         int T_dsq = 160;
         int B_dsq = (Ne - er) / 2 + 1;
 
-        // Generate the geometry of the blocks to update the denoiser
+        // Set enough memory in d_dsq to zero to compute the new distances
+        cudaMemset(d_dsq, 0.0f, (Ne - er) * Nr * sizeof(float));
+
+        calculate_dsq<<<B_dsq, T_dsq>>>(d_dsq, d_envs, d_rots, er, Ne, Nr, No);
+    };
+
+    // Store the weights of a reference above the threshold in the device buffers
+    const auto collect = [&](const int& er) {
         int T_den = 128;
         int B_den = (Ne - er) / T_den + 1;
 
-        // Set enough memory in d_dsq to zero to compute the new distances
-        cudaMemset(d_dsq, 0.0f, (Ne - er) * Nr * sizeof(float));
+        collect_weights<<<B_den, T_den>>>(
+            d_rows, d_cols, d_wgts, d_count, capacity, d_dsq, er, Ne, Nr, inv_den, w_thresh
+        );
+    };
+
+    // Copy the weights of the references [first, last) to the triplets of the graph
+    const auto flush = [&](const int& first, const int& last) {
+
+        // Number of weights stored for the batch of references
+        int count = 0;
+        cudaMemcpy(&count, d_count, sizeof(int), cudaMemcpyDeviceToHost);
+
+        if (count > capacity) {
+            cudaFree(d_rows); cudaFree(d_cols); cudaFree(d_wgts);
+
+            capacity = count;
+            cudaMalloc(&d_rows, capacity * sizeof(int));
+            cudaMalloc(&d_cols, capacity * sizeof(int));
+            cudaMalloc(&d_wgts, capacity * sizeof(float));
+
+            // The distances of the batch are gone, so they are computed again
+            cudaMemset(d_count, 0, sizeof(int));
+
+            for (int er = first; er < last; er++) {
+                distances(er); collect(er);
+            }
+        }
+
+        // Append the weights to the triplets of the graph
+        const size_t offset = g_cols.size();
+
+        g_rows.resize(offset + count);
+        g_cols.resize(offset + count);
+        g_wgts.resize(offset + count);
+
+        cudaMemcpy(g_rows.data() + offset, d_rows, count * sizeof(int),   cudaMemcpyDeviceToHost);
+        cudaMemcpy(g_cols.data() + offset, d_cols, count * sizeof(int),   cudaMemcpyDeviceToHost);
+        cudaMemcpy(g_wgts.data() + offset, d_wgts, count * sizeof(float), cudaMemcpyDeviceToHost);
+
+        cudaMemset(d_count, 0, sizeof(int));
+    };
+
+    // Iterate through all reference environments in the map
+    for (int er = 0; er < Ne; er++) {
+
+        // Generate the geometry of the blocks to update the denoiser
+        int T_den = 128;
+        int B_den = (Ne - er) / T_den + 1;
 
         // Calculate all possible distance squared in parallel
-        calculate_dsq<<<B_dsq, T_dsq>>>(d_dsq, d_envs, d_rots, er, Ne, Nr, No);
+        distances(er);
 
         // Update the denoised map and the sum of kernels
         update_denoiser<<<B_den, T_den>>>(
             d_dmap, d_sumk, d_dsq, d_omap, er, Ne, Nr, inv_den
         );
+
+        // Store the weights of the current reference above the threshold and copy
+        // them to the host once the batch of references is finished
+        if (graph != nullptr) {
+            collect(er);
+            if ((er + 1) % batch == 0 || er + 1 == Ne) flush(er - er % batch, er + 1);
+        }
     } // -- End of the denoiser loop
 
+    // Number of pairs of environments compared
+    Perf::add_items((uint64_t) Ne * (Ne + 1) / 2, "pairs");
+
+    // Construct the sparse graph of weights from the collected triplets
+    if (graph != nullptr) {
+        *graph = WeightGraph(map, g_rows, g_cols, g_wgts, w_thresh, hd);
+
+        cudaFree(d_rows);
+        cudaFree(d_cols);
+        cudaFree(d_wgts);
+        cudaFree(d_count);
+    }
+
     // Host allocated version of the sum of kernels
     float* sum_kernels = new float[Ne];
 
@@ -342,13 +490,22 @@ std::tuple<Map, float> Denoiser::nlmeans_denoiser(
     cudaMemcpy(denoised_M,  d_dmap, Ne * sizeof(float), cudaMemcpyDeviceToHost);
     cudaMemcpy(sum_kernels, d_sumk, Ne * sizeof(float), cudaMemcpyDeviceToHost);
 
+    // Store the data needed to re-denoise the map incrementally
+    state.p_thresh = p_thresh;
+    state.r_env    = r_env;
+    state.hd       = hd;
+    state.omap.assign(original_M,  original_M + Ne);
+    state.envs.assign(envs,        envs + Ne * No);
+    state.env_avg.assign(env_avg.begin(), env_avg.end());
+    state.dmap.assign(denoised_M,  denoised_M + Ne);
+    state.sumk.assign(sum_kernels, sum_kernels + Ne);
+
     // Normalise the data using the sum of kernels
     for (int er = 0; er < Ne; er++) {
         denoised_M[er] = denoised_M[er] / sum_kernels[er];
     }
 
     // Delete the heap allocated data
-    delete[] envs;
     delete[] rots;
     delete[] sum_kernels;
 
@@ -358,6 +515,526 @@ std::tuple<Map, float> Denoiser::nlmeans_denoiser(
     cudaFree(d_envs);
     cudaFree(d_rots);
     cudaFree(d_sumk);
+    cudaFree(d_dsq);
+
+    // Return a tuple containing the denoised map and the denoised parameter
+    return std::make_tuple(denoised_map, hd);
+}
+// -- }}}
+
+// -- Denoise several maps on the same grid sharing one distance computation {{{
+__host__
+std::tuple<vector<Map>, float> Denoiser::nlmeans_joint(
+    vector<Map>& maps, const float* envs, const vector<float>& env_avg, const float& p_thresh
+) {
+    // -- The kernels are computed once using the environments of a guide map,
+    // -- envs and env_avg, and applied to the values of all K maps in the same
+    // -- pass. The guide can be one of the maps or their average, whose 
+    // -- environments are the average of the environments of all maps.
+
+    // Construct some needed aliases
+    const int& Ne = maps[0].get_volume(); // -- Number of environments (points) in the map
+    const int& No = Octanct::No;          // -- Number of octancts in an env (8)
+    const int& Nr = Octanct::Nr;          // -- Number of rotations per comp (10)
+    const int  K  = maps.size();          // -- Number of maps denoised together
+
+    // All maps must be defined on the same grid
+    for (const auto& map : maps) {
+        if (map.Nu != maps[0].Nu || map.Nv != maps[0].Nv || map.Nw != maps[0].Nw) {
+            throw std::runtime_error("Maps denoised together must share the grid");
+        }
+    }
+
+    // Interleave the values of all maps, the map k at point e is located at e * K + k
+    vector<float> original_M(Ne * K), denoised_M(Ne * K);
+
+    for (int k = 0; k < K; k++) {
+        for (int e = 0; e < Ne; e++) original_M[e * K + k] = maps[k][e];
+    }
+
+    // Table containing the rotated indices for each needed rotation
+    const octanct* rots = Octanct::table_of_rotations();
+
+    // Calculate the denoising parameter using the threshold provided
+    const float hd      = denoising_parameter(env_avg, p_thresh);
+    const float inv_den = 1 / (2 * hd * hd);
+
+    // Generate the device copies of the relevant objects
+    float* d_omap; float* d_dmap; float* d_envs; 
+    octanct* d_rots; float* d_sumk; float* d_dsq;
+
+    // Allocate some memory for the needed objects
+    cudaMalloc(&d_omap, Ne * K * sizeof(float));    // -- Original maps
+    cudaMalloc(&d_dmap, Ne * K * sizeof(float));    // -- Denoised maps
+    cudaMalloc(&d_sumk, Ne * sizeof(float));        // -- Sum of kernels
+    cudaMalloc(&d_envs, Ne * No * sizeof(float));   // -- Environments of the guide
+    cudaMalloc(&d_rots, Nr * No * sizeof(octanct)); // -- Table of rotations
+    cudaMalloc(&d_dsq,  Ne * Nr * sizeof(float));   // -- Distance squared values
+
+    // Copy the original maps, the environments and the table of rotations
+    cudaMemcpy(d_envs, envs,              Ne * No * sizeof(float),   cudaMemcpyHostToDevice);
+    cudaMemcpy(d_omap, original_M.data(), Ne * K * sizeof(float),    cudaMemcpyHostToDevice);
+    cudaMemcpy(d_rots, rots,              Nr * No * sizeof(octanct), cudaMemcpyHostToDevice);
+
+    // Set the denoised maps and the sum of kernels to zero
+    cudaMemset(d_dmap, 0.0f, Ne * K * sizeof(float));
+    cudaMemset(d_sumk, 0.0f, Ne * sizeof(float));
+
+    // Iterate through all reference environments in the map
+    for (int er = 0; er < Ne; er++) {
+
+        // Generate the geometry of the blocks to compute the distance squared
+        int T_dsq = 160;
+        int B_dsq = (Ne - er) / 2 + 1;
+
+        // Generate the geometry of the blocks to update the denoiser
+        int T_den = 128;
+        int B_den = (Ne - er) / T_den + 1;
+
+        // Set enough memory in d_dsq to zero to compute the new distances
+        cudaMemset(d_dsq, 0.0f, (Ne - er) * Nr * sizeof(float));
+
+        // Calculate all possible distance squared in parallel
+        calculate_dsq<<<B_dsq, T_dsq>>>(d_dsq, d_envs, d_rots, er, Ne, Nr, No);
+
+        // Update all denoised maps and the sum of kernels
+        update_joint<<<B_den, T_den>>>(
+            d_dmap, d_sumk, d_dsq, d_omap, er, Ne, Nr, K, inv_den
+        );
+    } // -- End of the denoiser loop
+
+    // Number of pairs of environments compared
+    Perf::add_items((uint64_t) Ne * (Ne + 1) / 2, "pairs");
+
+    // Host allocated version of the sum of kernels
+    vector<float> sum_kernels(Ne);
+
+    // Copy the sum of kernels and the denoised maps to the host
+    cudaMemcpy(denoised_M.data(),  d_dmap, Ne * K * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(sum_kernels.data(), d_sumk, Ne * sizeof(float),     cudaMemcpyDeviceToHost);
+
+    // Generate copies of the maps and normalise the data using the sum of kernels
+    vector<Map> denoised_maps(maps.begin(), maps.end());
+
+    for (int k = 0; k < K; k++) {
+        for (int er = 0; er < Ne; er++) {
+            denoised_maps[k][er] = denoised_M[er * K + k] / sum_kernels[er];
+        }
+    }
+
+    // Delete the heap allocated data
+    delete[] rots;
+
+    // Delete the device allocated data
+    cudaFree(d_omap);
+    cudaFree(d_dmap);
+    cudaFree(d_envs);
+    cudaFree(d_rots);
+    cudaFree(d_sumk);
+    cudaFree(d_dsq);
+
+    // Return a tuple containing the denoised maps and the denoised parameter
+    return std::make_tuple(denoised_maps, hd);
+}
+
+__host__
+Map Denoiser::average_map(const vector<Map>& maps)
+{
+    // All maps must be defined on the same grid
+    for (const auto& map : maps) {
+        if (map.Nu != maps[0].Nu || map.Nv != maps[0].Nv || map.Nw != maps[0].Nw) {
+            throw std::runtime_error("Maps averaged together must share the grid");
+        }
+    }
+
+    // Generate a copy of the first map to store the average
+    Map average = maps[0];
+
+    for (int e = 0; e < average.get_volume(); e++) {
+
+        // Sum of the values of all maps at the current point
+        float sum = 0.0f;
+        for (const auto& map : maps) sum += map[e];
+
+        average[e] = sum / maps.size();
+    }
+
+    return average;
+}
+// -- }}}
+
+// -- Approximate denoiser using clusters of similar environments {{{
+__host__
+std::tuple<Map, float, float> Denoiser::nlmeans_approx(
+    Map& map, const float* envs, const vector<float>& env_avg, const float& p_thresh,
+    const int& num_clusters, const int& num_nbrs
+) {
+    // -- The environments are clustered using mini-batch k-means on their
+    // -- canonical orientation. Each environment is compared exactly against the 
+    // -- members of the num_nbrs clusters nearest to its own, while the rest of
+    // -- clusters are summarised by their centroid. The cost is O(Ne * Ne * M / K)
+    // -- instead of O(Ne^2). Returns the denoised map, the denoising parameter and
+    // -- the fraction of kernel mass captured exactly, estimated on a sample.
+
+    // Construct some needed aliases
+    const int& Ne = map.get_volume(); // -- Number of environments (points) in the map
+    const int& No = Octanct::No;      // -- Number of octancts in an env (8)
+    const int& Nr = Octanct::Nr;      // -- Number of rotations per comp (10)
+
+    // Use sqrt(Ne) clusters by default
+    const int K_req = (num_clusters > 0) ? num_clusters : std::lround(std::sqrt(Ne));
+
+    // Cluster the environments and find the nearest clusters of each cluster
+    const float* descs = Cluster::canonical_envs(envs, Ne);
+    const Cluster::Clusters clusters = Cluster::minibatch_kmeans(descs, Ne, K_req);
+    delete[] descs;
+    const vector<int> nbrs = Cluster::nearest_clusters(clusters, num_nbrs);
+
+    const int& K  = clusters.K;        // -- Number of clusters
+    const int  Nm = nbrs.size() / K;   // -- Number of neighbouring clusters
+
+    // Sort the environments by cluster, so each cluster is a contiguous range
+    vector<int> order(Ne);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](const int& a, const int& b) {
+        return clusters.labels[a] < clusters.labels[b];
+    });
+
+    vector<float> s_envs(Ne * No), s_omap(Ne), c_sum(K, 0.0f);
+    vector<int> s_labels(Ne), c_start(K + 1, 0);
+
+    for (int i = 0; i < Ne; i++) {
+        std::copy(envs + order[i] * No, envs + order[i] * No + No, &s_envs[i * No]);
+        s_omap[i]   = map[order[i]];
+        s_labels[i] = clusters.labels[order[i]];
+        c_sum[s_labels[i]] += s_omap[i];
+    }
+
+    for (int c = 0; c < K; c++) c_start[c + 1] = c_start[c] + clusters.counts[c];
+
+    // Table containing the rotated indices for each needed rotation
+    const octanct* rots = Octanct::table_of_rotations();
+
+    // Calculate the denoising parameter using the threshold provided
+    const float hd      = denoising_parameter(env_avg, p_thresh);
+    const float inv_den = 1 / (2 * hd * hd);
+
+    // Environments sampled to estimate the captured kernel mass
+    const int S = std::min(Ne, 256);
+    vector<int> samples(S);
+    for (int s = 0; s < S; s++) samples[s] = (long int) s * Ne / S;
+
+    // Generate the device copies of the relevant objects
+    float* d_dmap; float* d_sumk; float* d_mass; float* d_full; float* d_envs; 
+    float* d_omap; float* d_cent; float* d_csum; int* d_labels; int* d_cstart; 
+    int* d_nbrs; int* d_count; int* d_samples; octanct* d_rots;
+
+    // Allocate some memory for the needed objects
+    cudaMalloc(&d_dmap,    Ne * sizeof(float));        // -- Denoised map
+    cudaMalloc(&d_sumk,    Ne * sizeof(float));        // -- Sum of kernels
+    cudaMalloc(&d_mass,    Ne * sizeof(float));        // -- Exact sum of kernels
+    cudaMalloc(&d_full,    S * sizeof(float));         // -- Exhaustive sum of kernels
+    cudaMalloc(&d_envs,    Ne * No * sizeof(float));   // -- Sorted environments
+    cudaMalloc(&d_omap,    Ne * sizeof(float));        // -- Sorted original map
+    cudaMalloc(&d_cent,    K * No * sizeof(float));    // -- Centroids of the clusters
+    cudaMalloc(&d_csum,    K * sizeof(float));         // -- Sum of values per cluster
+    cudaMalloc(&d_labels,  Ne * sizeof(int));          // -- Sorted cluster labels
+    cudaMalloc(&d_cstart,  (K + 1) * sizeof(int));     // -- Start of each cluster
+    cudaMalloc(&d_nbrs,    K * Nm * sizeof(int));      // -- Nearest clusters
+    cudaMalloc(&d_count,   K * sizeof(int));           // -- Members of each cluster
+    cudaMalloc(&d_samples, S * sizeof(int));           // -- Sampled environments
+    cudaMalloc(&d_rots,    Nr * No * sizeof(octanct)); // -- Table of rotations
+
+    // Copy all the data needed by the kernels
+    cudaMemcpy(d_envs,    s_envs.data(),             Ne * No * sizeof(float),   cudaMemcpyHostToDevice);
+    cudaMemcpy(d_omap,    s_omap.data(),             Ne * sizeof(float),        cudaMemcpyHostToDevice);
+    cudaMemcpy(d_cent,    clusters.centroids.data(), K * No * sizeof(float),    cudaMemcpyHostToDevice);
+    cudaMemcpy(d_csum,    c_sum.data(),              K * sizeof(float),         cudaMemcpyHostToDevice);
+    cudaMemcpy(d_labels,  s_labels.data(),           Ne * sizeof(int),          cudaMemcpyHostToDevice);
+    cudaMemcpy(d_cstart,  c_start.data(),            (K + 1) * sizeof(int),     cudaMemcpyHostToDevice);
+    cudaMemcpy(d_nbrs,    nbrs.data(),               K * Nm * sizeof(int),      cudaMemcpyHostToDevice);
+    cudaMemcpy(d_count,   clusters.counts.data(),    K * sizeof(int),           cudaMemcpyHostToDevice);
+    cudaMemcpy(d_samples, samples.data(),            S * sizeof(int),           cudaMemcpyHostToDevice);
+    cudaMemcpy(d_rots,    rots,                      Nr * No * sizeof(octanct), cudaMemcpyHostToDevice);
+
+    // Generate the geometry of the blocks, one thread per environment. The columns
+    // of each sample are split over up to 32 blocks
+    int T_den = 128;
+    int B_den = Ne / T_den + 1;
+    int B_smp = S * std::min(32, Ne / T_den + 1);
+
+    // The exhaustive mass is accumulated by the blocks of each sample
+    cudaMemset(d_full, 0.0f, S * sizeof(float));
+
+    // Denoise all environments and compute the exhaustive mass of the sample
+    approx_denoiser<<<B_den, T_den>>>(
+        d_dmap, d_sumk, d_mass, d_envs, d_omap, d_labels, d_cstart, d_nbrs, 
+        d_cent, d_csum, d_count, d_rots, Ne, K, Nm, Nr, No, inv_den
+    );
+    exhaustive_mass<<<B_smp, T_den>>>(d_full, d_samples, d_envs, d_rots, S, Ne, Nr, No, inv_den);
+
+    // Number of pairs of environments compared exactly
+    uint64_t num_pairs = 0;
+
+    for (int c = 0; c < K; c++) {
+        for (int m = 0; m < Nm; m++) {
+            num_pairs += (uint64_t) clusters.counts[c] * clusters.counts[nbrs[c * Nm + m]];
+        }
+    }
+
+    Perf::add_items(num_pairs, "pairs");
+
+    // Host allocated version of the results
+    vector<float> s_dmap(Ne), sum_kernels(Ne), exact_mass(Ne), full_mass(S);
+
+    cudaMemcpy(s_dmap.data(),      d_dmap, Ne * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(sum_kernels.data(), d_sumk, Ne * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(exact_mass.data(),  d_mass, Ne * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(full_mass.data(),   d_full, S * sizeof(float),  cudaMemcpyDeviceToHost);
+
+    // Generate a copy of the map and normalise the data back in the original order
+    Map denoised_map = map;
+
+    for (int i = 0; i < Ne; i++) {
+        denoised_map[order[i]] = s_dmap[i] / sum_kernels[i];
+    }
+
+    // Fraction of the kernel mass computed exactly, averaged over the sample
+    float captured = 0.0f;
+    for (int s = 0; s < S; s++) captured += exact_mass[samples[s]] / full_mass[s];
+    captured /= S;
+
+    // Delete the heap allocated data
+    delete[] rots;
+
+    // Delete the device allocated data
+    cudaFree(d_dmap);
+    cudaFree(d_sumk);
+    cudaFree(d_mass);
+    cudaFree(d_full);
+    cudaFree(d_envs);
+    cudaFree(d_omap);
+    cudaFree(d_cent);
+    cudaFree(d_csum);
+    cudaFree(d_labels);
+    cudaFree(d_cstart);
+    cudaFree(d_nbrs);
+    cudaFree(d_count);
+    cudaFree(d_samples);
+    cudaFree(d_rots);
+
+    // Return a tuple containing the denoised map, the parameter and the captured mass
+    return std::make_tuple(denoised_map, hd, captured);
+}
+// -- }}}
+
+// -- Denoising parameter obtained from the spread of the environment averages {{{
+__host__
+float Denoiser::denoising_parameter(const vector<float>& env_avg, const float& p_thresh)
+{
+    // Get the maximum and minimum environment average
+    const auto min = std::min_element(env_avg.begin(), env_avg.end());
+    const auto max = std::max_element(env_avg.begin(), env_avg.end());
+
+    return 0.5 * p_thresh * (*max - *min);
+}
+// -- }}}
+
+// -- Environments whose stencil touches at least one changed point {{{
+__host__
+vector<int> Denoiser::affected_envs(Map& map, const vector<bool>& changed, const float& r_env)
+{
+    // First, obtain a table of near indices
+    const auto indices = table_of_indices(map, r_env);
+
+    // Number of environments in the map
+    const int Ne = map.get_volume();
+
+    // The mask must contain one flag per point of the grid
+    if ((int) changed.size() != Ne) {
+        throw std::runtime_error("Mask of changed points does not match the map grid");
+    }
+
+    // Mask used to avoid repeated environments
+    vector<bool> is_affected(Ne, false);
+
+    // The environment around e contains e + p, so e = c - p is affected by c
+    for (int c = 0; c < Ne; c++) {
+
+        // Only changed points modify the environments
+        if (!changed[c]) continue;
+
+        // Grid coordinates of the changed point
+        const int cu = c % map.Nu;
+        const int cv = (c / map.Nu) % map.Nv;
+        const int cw = c / (map.Nu * map.Nv);
+
+        for (auto& p : indices) {
+            is_affected[map.grid.index_s(cu - p.u, cv - p.v, cw - p.w)] = true;
+        }
+    }
+
+    // Vector containing the indices of all affected environments
+    vector<int> affected;
+
+    for (int e = 0; e < Ne; e++) {
+        if (is_affected[e]) affected.push_back(e);
+    }
+
+    return affected;
+}
+// -- }}}
+
+// -- Re-denoise a map whose changed points are found using the previous run {{{
+__host__
+std::tuple<Map, float> Denoiser::nlmeans_redenoiser(Map& map, DenoiserState& state)
+{
+    // Number of environments in the map
+    const int Ne = map.get_volume();
+
+    // The previous run must correspond to the same grid
+    if ((int) state.omap.size() != Ne) {
+        throw std::runtime_error("Denoiser state does not match the map grid");
+    }
+
+    // Points whose value differs from the one used in the previous run
+    vector<bool> changed(Ne);
+
+    for (int e = 0; e < Ne; e++) {
+        changed[e] = (map[e] != state.omap[e]);
+    }
+
+    return nlmeans_redenoiser(map, changed, state);
+}
+
+__host__
+std::tuple<Map, float> Denoiser::nlmeans_redenoiser(
+    Map& map, const vector<bool>& changed, DenoiserState& state
+) {
+    // -- Update the accumulators of a previous run after a localised change in the
+    // -- map. Only the environments whose stencil touches a changed point are 
+    // -- recomputed, and only the pairs containing one of them are updated. The 
+    // -- cost is proportional to the number of affected environments times Ne.
+
+    // Construct some needed aliases
+    const int& Ne = map.get_volume(); // -- Number of environments (points) in the map
+    const int& No = Octanct::No;      // -- Number of octancts in an env (8)
+    const int& Nr = Octanct::Nr;      // -- Number of rotations per comp (10)
+
+    // The previous run and the mask must correspond to the same grid
+    if ((int) state.omap.size() != Ne || (int) changed.size() != Ne) {
+        throw std::runtime_error("Denoiser state does not match the map grid");
+    }
+
+    // Environments whose value changes after the modification
+    const auto affected = affected_envs(map, changed, state.r_env);
+
+    // First, obtain a table of near indices
+    const auto indices = table_of_indices(map, state.r_env);
+
+    // Recompute the environments and their averages only at the affected points
+    vector<float> n_envs = state.envs;
+    vector<float> env_avg = state.env_avg;
+
+    for (const int& e : affected) {
+
+        // Grid coordinates of the affected environment
+        const int u = e % map.Nu;
+        const int v = (e / map.Nu) % map.Nv;
+        const int w = e / (map.Nu * map.Nv);
+
+        env_of_point(n_envs.data() + e * No, map, u, v, w, indices);
+        env_avg[e] = avg_of_point(map, u, v, w, indices);
+    }
+
+    // A different denoising parameter modifies all kernels, a full run is needed
+    const float hd = denoising_parameter(env_avg, state.p_thresh);
+
+    if (hd != state.hd) {
+        return nlmeans_denoiser(map, state.p_thresh, state.r_env, state);
+    }
+
+    // Inverse of the denominator used in the kernel
+    const float inv_den = 1 / (2 * hd * hd);
+
+    // Generate a copy of the map to denoise it
+    Map denoised_map = map;
+
+    // Pointers to the denoised map and original map memory blocks
+    float* denoised_M = denoised_map.data();
+    float* original_M = map.data();
+
+    // Table containing the rotated indices for each needed rotation
+    const octanct* rots = Octanct::table_of_rotations();
+
+    // Mask of affected environments used to avoid updating the same pair twice
+    vector<unsigned char> is_affected(Ne, 0);
+    for (const int& e : affected) is_affected[e] = 1;
+
+    // Generate the device copies of the relevant objects
+    float* d_omap_old; float* d_omap_new; float* d_envs_old; float* d_envs_new;
+    float* d_dmap; float* d_sumk; octanct* d_rots; unsigned char* d_aff;
+
+    // Allocate some memory for the needed objects
+    cudaMalloc(&d_omap_old, Ne * sizeof(float));         // -- Old original map
+    cudaMalloc(&d_omap_new, Ne * sizeof(float));         // -- New original map
+    cudaMalloc(&d_envs_old, Ne * No * sizeof(float));    // -- Old environments
+    cudaMalloc(&d_envs_new, Ne * No * sizeof(float));    // -- New environments
+    cudaMalloc(&d_dmap,     Ne * sizeof(float));         // -- Denoised map
+    cudaMalloc(&d_sumk,     Ne * sizeof(float));         // -- Sum of kernels
+    cudaMalloc(&d_rots,     Nr * No * sizeof(octanct));  // -- Table of rotations
+    cudaMalloc(&d_aff,      Ne * sizeof(unsigned char)); // -- Affected environments
+
+    // Copy the old and new data, the accumulators and the table of rotations
+    cudaMemcpy(d_omap_old, state.omap.data(),  Ne * sizeof(float),         cudaMemcpyHostToDevice);
+    cudaMemcpy(d_omap_new, original_M,         Ne * sizeof(float),         cudaMemcpyHostToDevice);
+    cudaMemcpy(d_envs_old, state.envs.data(),  Ne * No * sizeof(float),    cudaMemcpyHostToDevice);
+    cudaMemcpy(d_envs_new, n_envs.data(),      Ne * No * sizeof(float),    cudaMemcpyHostToDevice);
+    cudaMemcpy(d_dmap,     state.dmap.data(),  Ne * sizeof(float),         cudaMemcpyHostToDevice);
+    cudaMemcpy(d_sumk,     state.sumk.data(),  Ne * sizeof(float),         cudaMemcpyHostToDevice);
+    cudaMemcpy(d_rots,     rots,               Nr * No * sizeof(octanct),  cudaMemcpyHostToDevice);
+    cudaMemcpy(d_aff,      is_affected.data(), Ne * sizeof(unsigned char), cudaMemcpyHostToDevice);
+
+    // Iterate through all affected environments in the map
+    for (const int& ea : affected) {
+
+        // Generate the geometry of the blocks to update the pairs
+        int T_pair = 128;
+        int B_pair = Ne / T_pair + 1;
+
+        // Replace the contributions of all pairs containing ea
+        update_pairs<<<B_pair, T_pair>>>(
+            d_dmap, d_sumk, d_envs_old, d_envs_new, d_omap_old, d_omap_new, d_rots, 
+            d_aff, ea, Ne, Nr, No, inv_den
+        );
+    } // -- End of the re-denoiser loop
+
+    // Copy the updated accumulators to the state
+    cudaMemcpy(state.dmap.data(), d_dmap, Ne * sizeof(float), cudaMemcpyDeviceToHost);
+    cudaMemcpy(state.sumk.data(), d_sumk, Ne * sizeof(float), cudaMemcpyDeviceToHost);
+
+    // Store the new data in the state for the following runs
+    state.omap.assign(original_M, original_M + Ne);
+    state.envs    = std::move(n_envs);
+    state.env_avg = std::move(env_avg);
+
+    // Normalise the data using the sum of kernels
+    for (int er = 0; er < Ne; er++) {
+        denoised_M[er] = state.dmap[er] / state.sumk[er];
+    }
+
+    // Delete the heap allocated data
+    delete[] rots;
+
+    // Delete the device allocated data
+    cudaFree(d_omap_old);
+    cudaFree(d_omap_new);
+    cudaFree(d_envs_old);
+    cudaFree(d_envs_new);
+    cudaFree(d_dmap);
+    cudaFree(d_sumk);
+    cudaFree(d_rots);
+    cudaFree(d_aff);
 
     // Return a tuple containing the denoised map and the denoised parameter
     return std::make_tuple(denoised_map, hd);
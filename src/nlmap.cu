@@ -0,0 +1,132 @@
+#include <nlmap.h>
+
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+// User defined modules
+#include <Map.hpp>
+#include <denoiser.hpp>
+
+// -- Definition of the opaque handle exposed in the C interface
+struct nlmap_map
+{
+    Map map;
+};
+
+// Message of the last error produced in the current thread
+static thread_local std::string last_error;
+
+// -- Run a function translating all exceptions into the error status {{{
+template <typename F>
+static int guarded(F&& func)
+{
+    try {
+        func(); return 0;
+    } catch (const std::exception& error) {
+        last_error = error.what();
+    } catch (...) {
+        last_error = "Unknown error";
+    }
+    return -1;
+}
+// -- }}}
+
+// -- Copy of the map whose values are replaced by the caller's buffer {{{
+static Map map_with_values(const nlmap_map* handle, const float* values)
+{
+    if (handle == nullptr) throw std::invalid_argument("Map handle is NULL");
+
+    // Generate a working copy, as the denoiser modules mutate the map
+    Map work = handle->map;
+
+    if (values != nullptr) {
+        std::copy(values, values + work.get_volume(), work.data());
+    }
+
+    return work;
+}
+// -- }}}
+
+const char* nlmap_last_error(void)
+{
+    return last_error.c_str();
+}
+
+int nlmap_set_device(int device)
+{
+    if (cudaSetDevice(device) != cudaSuccess) {
+        last_error = "Unable to set the CUDA device";
+        return -1;
+    }
+    return 0;
+}
+
+nlmap_map* nlmap_map_load(const char* path)
+{
+    nlmap_map* handle = nullptr;
+
+    guarded([&]() { handle = new nlmap_map{Map(path)}; });
+
+    return handle;
+}
+
+void nlmap_map_free(nlmap_map* map)
+{
+    delete map;
+}
+
+int nlmap_map_shape(const nlmap_map* map, int shape[3])
+{
+    return guarded([&]() {
+        if (map == nullptr) throw std::invalid_argument("Map handle is NULL");
+        shape[0] = map->map.Nu; shape[1] = map->map.Nv; shape[2] = map->map.Nw;
+    });
+}
+
+float* nlmap_map_data(nlmap_map* map)
+{
+    return (map != nullptr) ? map->map.data() : nullptr;
+}
+
+int nlmap_map_save(const nlmap_map* map, const float* values, const char* path)
+{
+    return guarded([&]() { map_with_values(map, values).save_map(path); });
+}
+
+int nlmap_envs(const nlmap_map* map, const float* values, float r_env, float* envs)
+{
+    return guarded([&]() {
+        Map work = map_with_values(map, values);
+
+        // Write the table of environments directly into the caller's buffer
+        Denoiser::table_of_envs(work, r_env, envs);
+    });
+}
+
+int nlmap_stats(const nlmap_map* map, const float* values, float r_env, float* stats)
+{
+    return guarded([&]() {
+        Map work = map_with_values(map, values);
+
+        // Write the table of averages directly into the caller's buffer
+        Denoiser::table_of_stats(work, r_env, stats);
+    });
+}
+
+int nlmap_denoise(
+    const nlmap_map* map, const float* values, float p_thresh, float r_env,
+    float* denoised, float* hd
+) {
+    return guarded([&]() {
+        Map work = map_with_values(map, values);
+
+        // Denoise the map using the map denoiser
+        auto denoiser_output = Denoiser::nlmeans_denoiser(work, p_thresh, r_env);
+
+        Map& denoised_map = std::get<0>(denoiser_output);
+        std::copy(denoised_map.data(), denoised_map.data() + work.get_volume(), denoised);
+
+        if (hd != nullptr) *hd = std::get<1>(denoiser_output);
+    });
+}
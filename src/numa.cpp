@@ -0,0 +1,201 @@
+#include <numa.hpp>
+
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// -- Topology of the host, each node contains a list of CPUs {{{
+struct Topology
+{
+    std::vector<std::vector<int>> cpus; // CPUs of each node
+    std::vector<int> node_of_cpu;       // Node of each CPU
+};
+
+// Parse a list of CPUs or nodes in the kernel format, for example 0-3,8-11
+static std::vector<int> parse_list(const std::string& list)
+{
+    std::vector<int> ids;
+    std::stringstream stream(list);
+
+    for (std::string range; std::getline(stream, range, ',');) {
+
+        if (range.empty()) continue;
+
+        const size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last  = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+
+        for (int id = first; id <= last; id++) ids.push_back(id);
+    }
+
+    return ids;
+}
+
+// Read the first line of a file, empty if it cannot be read
+static std::string read_line(const std::string& path)
+{
+    std::ifstream stream(path);
+    std::string line; std::getline(stream, line);
+
+    return line;
+}
+
+static const Topology& topology()
+{
+    // -- The topology is read once. The node ids of the kernel may be sparse,
+    // -- so the online nodes containing CPUs are numbered consecutively; nodes
+    // -- containing only memory are skipped. If the host does not expose its
+    // -- nodes, all CPUs are placed on a single node.
+    static const Topology topo = []() {
+
+        Topology topo;
+
+        const std::string base = "/sys/devices/system/node/";
+
+        for (const int& id : parse_list(read_line(base + "online"))) {
+
+            const auto cpus = parse_list(read_line(base + "node" + std::to_string(id) + "/cpulist"));
+            if (!cpus.empty()) topo.cpus.push_back(cpus);
+        }
+
+        if (topo.cpus.empty()) {
+            topo.cpus.emplace_back();
+            for (int cpu = 0; cpu < (int) std::thread::hardware_concurrency(); cpu++) {
+                topo.cpus[0].push_back(cpu);
+            }
+        }
+
+        for (int node = 0; node < (int) topo.cpus.size(); node++) {
+            for (const int& cpu : topo.cpus[node]) {
+                if (cpu >= (int) topo.node_of_cpu.size()) topo.node_of_cpu.resize(cpu + 1, 0);
+                topo.node_of_cpu[cpu] = node;
+            }
+        }
+
+        return topo;
+    }();
+
+    return topo;
+}
+// -- }}}
+
+// -- Placement options {{{
+Numa::Options& Numa::options()
+{
+    static Options opts;
+    return opts;
+}
+// -- }}}
+
+// -- Topology of the host {{{
+int Numa::num_nodes()
+{
+    return topology().cpus.size();
+}
+
+const std::vector<int>& Numa::node_cpus(const int& node)
+{
+    return topology().cpus[node];
+}
+// -- }}}
+
+// -- Node assigned to the thread t of a loop using Nt threads {{{
+int Numa::node_of_thread(const int& t, const int& Nt)
+{
+    // Consecutive threads, and then consecutive chunks of data, share a node
+    return (long int) t * num_nodes() / Nt;
+}
+// -- }}}
+
+// -- Pin the calling thread to the CPUs of a node {{{
+// Node of the calling thread once it is pinned, negative otherwise
+static thread_local int pinned_node = -1;
+
+// CPUs the calling thread could run on before it was pinned
+static thread_local cpu_set_t unpinned_set;
+
+void Numa::pin_to_node(const int& node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (const int& cpu : node_cpus(node)) CPU_SET(cpu, &set);
+
+    // Keep the affinity of the thread to restore it when it is unpinned
+    if (pinned_node < 0 && pthread_getaffinity_np(pthread_self(), sizeof(unpinned_set), &unpinned_set) != 0) {
+        return;
+    }
+
+    // Pinning is only an optimisation, so failures are ignored
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) pinned_node = node;
+}
+
+void Numa::unpin()
+{
+    if (pinned_node < 0) return;
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(unpinned_set), &unpinned_set) == 0) pinned_node = -1;
+}
+
+int Numa::current_node()
+{
+    if (pinned_node >= 0) return pinned_node;
+
+    // Use the node of the CPU currently running the thread
+    const int cpu = sched_getcpu();
+    const auto& node_of_cpu = topology().node_of_cpu;
+
+    return (cpu >= 0 && cpu < (int) node_of_cpu.size()) ? node_of_cpu[cpu] : 0;
+}
+// -- }}}
+
+// -- Request transparent huge pages for a region {{{
+void Numa::advise_huge_pages(void* ptr, const size_t& bytes)
+{
+    // -- madvise needs an aligned region, so only the huge pages fully contained
+    // -- in the region are requested. Regions smaller than a huge page are skipped.
+    if (!options().huge_pages) return;
+
+    const size_t huge = 2 << 20;
+
+    const size_t begin = (reinterpret_cast<size_t>(ptr) + huge - 1) & ~(huge - 1);
+    const size_t end   = (reinterpret_cast<size_t>(ptr) + bytes) & ~(huge - 1);
+
+    if (end > begin) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+}
+// -- }}}
+
+// -- Release the pages of a zero filled region, so they are first touched again {{{
+void Numa::release_pages(void* ptr, const size_t& bytes)
+{
+    // -- Containers such as std::vector zero fill their elements on the thread
+    // -- allocating them, which places all pages on its node. The pages fully
+    // -- contained in the region are released, so they are placed on the node of
+    // -- the thread writing them next. Released pages of private anonymous memory,
+    // -- as returned by the allocator, read as zero, so the contents are unchanged.
+    if (!options().pin) return;
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+
+    const size_t begin = (reinterpret_cast<size_t>(ptr) + page - 1) & ~(page - 1);
+    const size_t end   = (reinterpret_cast<size_t>(ptr) + bytes) & ~(page - 1);
+
+    if (end > begin) madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+}
+// -- }}}
+
+// -- Summary of the topology and the options used in the run {{{
+std::string Numa::summary()
+{
+    std::stringstream stream;
+
+    stream << num_nodes() << " node(s), pinning " << (options().pin ? "on" : "off")
+           << ", replicas " << (options().replicate ? "on" : "off")
+           << ", huge pages " << (options().huge_pages ? "on" : "off");
+
+    return stream.str();
+}
+// -- }}}
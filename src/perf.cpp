@@ -0,0 +1,217 @@
+#include <perf.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <iomanip>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// -- Records of the counters of each scope {{{
+struct Record
+{
+    std::string phase;            // Phase measured by the scope
+    long int tid;                 // Thread running the scope
+    uint64_t values[Perf::NumEvents];
+    bool valid[Perf::NumEvents];  // Counters that could be opened and read
+    uint64_t items;               // Work done in the scope
+    std::string unit;             // Unit of the work
+};
+
+// Records of all finished scopes, shared by all threads
+static std::vector<Record> records;
+static std::mutex records_lock;
+
+// Innermost scope of the calling thread
+static thread_local Perf::Scope* innermost = nullptr;
+// -- }}}
+
+// -- Open a counter of the calling thread {{{
+static int open_counter(const Perf::Event& event)
+{
+    // Cache events are encoded as cache | (operation << 8) | (result << 16)
+    const uint64_t read_miss =
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+
+    attr.size           = sizeof(attr);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch (event) {
+        case Perf::Cycles:
+            attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case Perf::Instructions:
+            attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case Perf::LLCMisses:
+            attr.type = PERF_TYPE_HW_CACHE; attr.config = PERF_COUNT_HW_CACHE_LL | read_miss; break;
+        case Perf::BranchMisses:
+            attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        default:
+            attr.type = PERF_TYPE_HW_CACHE; attr.config = PERF_COUNT_HW_CACHE_DTLB | read_miss; break;
+    }
+
+    // Measure the calling thread on any CPU. Returns -1 if the event is not available
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+// -- }}}
+
+// -- Enable the collection of counters {{{
+bool& Perf::enabled()
+{
+    static bool is_enabled = false;
+    return is_enabled;
+}
+// -- }}}
+
+// -- Counters of the calling thread while the scope is alive {{{
+Perf::Scope::Scope(const std::string& phase) : phase(phase), parent(innermost)
+{
+    innermost = this;
+
+    for (int ev = 0; ev < NumEvents; ev++) {
+        this->fds[ev] = enabled() ? open_counter(static_cast<Event>(ev)) : -1;
+    }
+
+    for (const int& fd : this->fds) {
+        if (fd < 0) continue;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+Perf::Scope::~Scope()
+{
+    innermost = this->parent;
+
+    if (!enabled()) return;
+
+    Record record{this->phase, syscall(SYS_gettid), {}, {}, this->items, this->unit};
+
+    for (int ev = 0; ev < NumEvents; ev++) {
+
+        if (this->fds[ev] < 0) continue;
+
+        ioctl(this->fds[ev], PERF_EVENT_IOC_DISABLE, 0);
+
+        // Value, time enabled and time running. Counters multiplexed with other
+        // events are scaled to the time the scope was enabled
+        uint64_t data[3];
+
+        if (read(this->fds[ev], data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+            record.values[ev] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+            record.valid[ev]  = true;
+        }
+
+        close(this->fds[ev]);
+    }
+
+    std::lock_guard<std::mutex> guard(records_lock);
+    records.push_back(record);
+}
+// -- }}}
+
+// -- Add work to the innermost scope of the calling thread {{{
+void Perf::add_items(const uint64_t& items, const std::string& unit)
+{
+    if (innermost == nullptr) return;
+
+    innermost->items += items;
+    innermost->unit   = unit;
+}
+// -- }}}
+
+// -- Phase of the innermost scope of the calling thread {{{
+std::string Perf::current_phase()
+{
+    return (innermost == nullptr) ? "" : innermost->phase;
+}
+// -- }}}
+
+// -- Output the counters per phase and thread and the derived metrics {{{
+// Output a counter or n/a if it is not available
+static void output_value(std::ostream& stream, const bool& valid, const double& value)
+{
+    if (valid) stream << " " << value; else stream << " n/a";
+}
+
+// Output a record and its derived metrics
+static void output_record(std::ostream& stream, const Record& r, const std::string& thread)
+{
+    stream << r.phase << " " << thread << std::setprecision(0);
+
+    for (int ev = 0; ev < Perf::NumEvents; ev++) output_value(stream, r.valid[ev], r.values[ev]);
+
+    stream << " " << r.items << " " << r.unit << std::setprecision(4);
+
+    // Instructions per cycle, bytes read from memory (LLC misses of 64 bytes)
+    // per item and items processed per cycle
+    const bool has_items = r.items > 0;
+
+    output_value(stream, r.valid[Perf::Cycles] && r.valid[Perf::Instructions] && r.values[Perf::Cycles] > 0,
+        (double) r.values[Perf::Instructions] / r.values[Perf::Cycles]);
+    output_value(stream, r.valid[Perf::LLCMisses] && has_items,
+        64.0 * r.values[Perf::LLCMisses] / r.items);
+    output_value(stream, r.valid[Perf::Cycles] && has_items && r.values[Perf::Cycles] > 0,
+        (double) r.items / r.values[Perf::Cycles]);
+
+    stream << "\n";
+}
+
+void Perf::report(std::ostream& stream)
+{
+    std::lock_guard<std::mutex> guard(records_lock);
+
+    stream << std::fixed;
+    stream << "# phase thread cycles instructions llc_misses branch_misses dtlb_misses "
+           << "items unit ipc bytes/item items/cycle\n";
+
+    // Phases in the order they finished
+    std::vector<std::string> phases;
+
+    for (const auto& r : records) {
+        if (std::find(phases.begin(), phases.end(), r.phase) == phases.end()) {
+            phases.push_back(r.phase);
+        }
+    }
+
+    bool any_valid = false;
+
+    for (const auto& phase : phases) {
+
+        // Sum of the counters of all threads of the phase
+        Record total{phase, 0, {}, {}, 0, "voxels"};
+        for (int ev = 0; ev < NumEvents; ev++) total.valid[ev] = true;
+
+        for (const auto& r : records) {
+
+            if (r.phase != phase) continue;
+
+            output_record(stream, r, std::to_string(r.tid));
+
+            for (int ev = 0; ev < NumEvents; ev++) {
+                total.values[ev] += r.values[ev];
+                total.valid[ev]  &= r.valid[ev];
+                any_valid        |= r.valid[ev];
+            }
+
+            total.items += r.items;
+            if (r.items > 0) total.unit = r.unit;
+        }
+
+        output_record(stream, total, "all");
+    }
+
+    if (!any_valid) {
+        stream << "# perf: hardware counters not available, check "
+               << "/proc/sys/kernel/perf_event_paranoid\n";
+    }
+}
+// -- }}}
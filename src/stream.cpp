@@ -0,0 +1,100 @@
+#include <stream.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+// User defined modules
+#include <utils.hpp>
+
+// Size of the chunks written into the file descriptors
+static const size_t chunk_bytes = 4 << 20;
+
+// -- Read a map from a file, or from stdin if the path is "-" {{{
+Map Stream::read_map(const std::string& path, const float& missing)
+{
+    if (path != "-") return Map(path, missing);
+
+    // -- The map is parsed sequentially as it arrives through the pipe, the
+    // -- header first and then the data. A large buffer reduces the number of
+    // -- reads on the pipe.
+    std::setvbuf(stdin, nullptr, _IOFBF, chunk_bytes);
+
+    Map map;
+    map.read_ccp4_stream(gemmi::FileStream{stdin}, "stdin");
+    map.setup(gemmi::GridSetup::Full, missing);
+
+    return map;
+}
+// -- }}}
+
+// -- Write a map into a file descriptor using large sequential chunks {{{
+template <typename TFile>
+static void write_values(const int& fd, const std::vector<float>& values)
+{
+    // Values converted to the type of the file, one chunk at a time
+    const size_t chunk = chunk_bytes / sizeof(TFile);
+    std::vector<TFile> work(std::min(chunk, values.size()));
+
+    for (size_t i = 0; i < values.size(); i += chunk) {
+
+        const size_t len = std::min(chunk, values.size() - i);
+        for (size_t j = 0; j < len; j++) work[j] = static_cast<TFile>(values[i + j]);
+
+        Stream::write_fd(fd, reinterpret_cast<const char*>(work.data()), len * sizeof(TFile));
+    }
+}
+
+void Stream::write_map(const int& fd, Map& map)
+{
+    // Same header and mode as Map::save_map
+    map.update_ccp4_header();
+
+    Stream::write_fd(
+        fd, reinterpret_cast<const char*>(map.ccp4_header.data()), 4 * map.ccp4_header.size()
+    );
+
+    const int mode = map.header_i32(4);
+
+    if (mode == 0) write_values<std::int8_t>(fd, map.grid.data);
+    else if (mode == 1) write_values<std::int16_t>(fd, map.grid.data);
+    else if (mode == 2) write_values<float>(fd, map.grid.data);
+    else if (mode == 6) write_values<std::uint16_t>(fd, map.grid.data);
+    else throw std::runtime_error("Mode " + std::to_string(mode) + " is not supported");
+}
+// -- }}}
+
+// -- Write the environment averages of a map into a file descriptor {{{
+void Stream::write_envstats(const int& fd, const std::vector<float>& estat, const Map& map)
+{
+    // Format the statistics in memory and write them at once
+    std::ostringstream stream;
+    Utils::write_envstats(stream, estat, map);
+
+    const std::string text = stream.str();
+    Stream::write_fd(fd, text.data(), text.size());
+}
+// -- }}}
+
+// -- Write a buffer into a file descriptor, retrying partial writes {{{
+void Stream::write_fd(const int& fd, const char* data, const size_t& bytes)
+{
+    for (size_t done = 0; done < bytes;) {
+
+        const ssize_t written = ::write(fd, data + done, std::min(chunk_bytes, bytes - done));
+
+        if (written < 0 && errno == EINTR) continue;
+
+        if (written <= 0) {
+            throw std::runtime_error(
+                "Failed to write into file descriptor " + std::to_string(fd) + ": " + std::strerror(errno)
+            );
+        }
+
+        done += written;
+    }
+}
+// -- }}}
@@ -0,0 +1,309 @@
+#include <taskgraph.hpp>
+
+#include <stdexcept>
+#include <algorithm>
+#include <iomanip>
+#include <atomic>
+#include <memory>
+
+// User defined modules
+#include <numa.hpp>
+#include <perf.hpp>
+
+// -- Thread pool {{{
+// Pool of the calling thread, null if it is not one of its workers
+static thread_local Tasks::ThreadPool* current_pool = nullptr;
+
+Tasks::ThreadPool::ThreadPool(const int& num_workers)
+{
+    // At least one worker is needed to make progress
+    const int Nw = std::max(num_workers, 1);
+
+    for (int i = 0; i < Nw; i++) {
+        this->workers.emplace_back([this]() {
+            current_pool = this;
+
+            while (true) {
+
+                // Job that will be executed by the worker
+                std::function<void()> job;
+
+                {
+                    std::unique_lock<std::mutex> guard(this->lock);
+                    this->available.wait(guard, [this]() {
+                        return this->stop || !this->jobs.empty();
+                    });
+
+                    // Finish the worker once all queued jobs are done
+                    if (this->stop && this->jobs.empty()) return;
+
+                    job = std::move(this->jobs.front()); this->jobs.pop();
+                }
+
+                job();
+            }
+        });
+    }
+}
+
+Tasks::ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->stop = true;
+    }
+    this->available.notify_all();
+
+    for (auto& worker : this->workers) worker.join();
+}
+
+void Tasks::ThreadPool::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->jobs.push(std::move(job));
+    }
+    this->available.notify_one();
+}
+
+int Tasks::ThreadPool::size() const
+{
+    return this->workers.size();
+}
+// -- }}}
+
+// -- Parallel loop {{{
+void Tasks::parallel_for(const int& n, const std::function<void(int, int)>& func)
+{
+    // -- The range is split in one chunk per hardware thread. The calling thread
+    // -- processes chunks until none is left, helped by the idle workers of its
+    // -- pool, so loops inside the tasks of a graph never wait on the pool and the
+    // -- number of threads is bounded by its size. Outside a pool, helper threads
+    // -- are created for the loop. func receives the range [begin, end) of each
+    // -- chunk. If pinning is enabled, the chunks are distributed over the NUMA
+    // -- nodes in order, so data first touched in one loop is read from the same
+    // -- node by later loops of the same size. Helpers are profiled as part of the
+    // -- phase of the calling thread.
+    const int Nt = std::max(1, std::min<int>(std::thread::hardware_concurrency(), n));
+
+    // State shared with the helpers, which may only start once the loop is finished
+    struct Loop
+    {
+        std::atomic<int> next{0}; // Next chunk to process
+        int finished = 0;         // Number of chunks processed
+        std::mutex lock;
+        std::condition_variable all_finished;
+        std::exception_ptr failure;
+    };
+
+    const auto loop = std::make_shared<Loop>();
+
+    // Phase profiled by the calling thread
+    const std::string phase = Perf::current_phase();
+
+    // Process chunks until none is left. func is only used while a chunk is pending
+    const auto work = [loop, &func, phase, n, Nt](const bool& helper) {
+
+        // The calling thread is already profiled by its own phase
+        std::unique_ptr<Perf::Scope> scope;
+
+        for (int t = loop->next++; t < Nt; t = loop->next++) {
+
+            if (!scope && (helper || phase.empty())) {
+                scope.reset(new Perf::Scope(phase.empty() ? "parallel_for" : phase));
+            }
+
+            // Contiguous range of indices processed in the current chunk
+            const int begin = (long int) n * t / Nt;
+            const int end   = (long int) n * (t + 1) / Nt;
+
+            try {
+                if (Numa::options().pin) Numa::pin_to_node(Numa::node_of_thread(t, Nt));
+                func(begin, end);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(loop->lock);
+                if (!loop->failure) loop->failure = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> guard(loop->lock);
+            if (++loop->finished == Nt) loop->all_finished.notify_all();
+        }
+
+        // Threads are shared with other stages, so their affinity is restored
+        Numa::unpin();
+    };
+
+    std::vector<std::thread> threads;
+
+    if (current_pool != nullptr) {
+        const int Nh = std::min(Nt - 1, current_pool->size() - 1);
+        for (int h = 0; h < Nh; h++) current_pool->submit([work]() { work(true); });
+    } else {
+        for (int h = 0; h < Nt - 1; h++) threads.emplace_back([&work]() { work(true); });
+    }
+
+    work(false);
+
+    {
+        std::unique_lock<std::mutex> guard(loop->lock);
+        loop->all_finished.wait(guard, [&loop, Nt]() { return loop->finished == Nt; });
+    }
+
+    for (auto& thread : threads) thread.join();
+
+    if (loop->failure) std::rethrow_exception(loop->failure);
+}
+// -- }}}
+
+// -- Task graph {{{
+int Tasks::TaskGraph::add_task(
+    const std::string& name, std::function<void()> func, const std::vector<int>& deps
+) {
+    // Identifier of the new task
+    const int id = this->tasks.size();
+
+    // Dependencies must be added before, which keeps the graph acyclic
+    for (const int& d : deps) {
+        if (d < 0 || d >= id) throw std::invalid_argument("Invalid dependency of " + name);
+    }
+
+    this->tasks.push_back(Task{name, std::move(func), deps, {}, 0, false, 0.0, 0.0});
+
+    for (const int& d : deps) this->tasks[d].children.push_back(id);
+
+    return id;
+}
+
+void Tasks::TaskGraph::run(ThreadPool& pool)
+{
+    // Reset the state of the graph
+    this->done = 0; this->failure = nullptr;
+    this->origin = std::chrono::steady_clock::now();
+
+    // Tasks without dependencies, found before any task can modify pending
+    std::vector<int> roots;
+
+    for (int t = 0; t < (int) this->tasks.size(); t++) {
+        this->tasks[t].pending = this->tasks[t].deps.size();
+        this->tasks[t].skip    = false;
+        if (this->tasks[t].pending == 0) roots.push_back(t);
+    }
+
+    // Submit all tasks without dependencies
+    for (const int& t : roots) {
+        pool.submit([this, &pool, t]() { this->execute(pool, t); });
+    }
+
+    // Wait until all tasks are finished
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->finished.wait(guard, [this]() { return this->done == (int) this->tasks.size(); });
+
+    if (this->failure) std::rethrow_exception(this->failure);
+}
+
+void Tasks::TaskGraph::execute(ThreadPool& pool, const int& t)
+{
+    Task& task = this->tasks[t];
+
+    // Seconds elapsed since the start of the graph
+    const auto elapsed = [this]() {
+        return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - this->origin
+        ).count();
+    };
+
+    task.start = elapsed();
+
+    // Tasks depending on a failed task are not executed
+    if (!task.skip) {
+        try {
+            // Hardware counters of the task, only collected if enabled
+            Perf::Scope scope(task.name);
+            task.func();
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (!this->failure) this->failure = std::current_exception();
+            task.skip = true;
+        }
+    }
+
+    task.end = elapsed();
+
+    // Tasks whose dependencies are all finished
+    std::vector<int> ready;
+
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        for (const int& c : task.children) {
+            if (task.skip) this->tasks[c].skip = true;
+            if (--this->tasks[c].pending == 0) ready.push_back(c);
+        }
+
+        // Notify while locked, as run may return and destroy the graph afterwards
+        this->done++;
+        this->finished.notify_all();
+    }
+
+    for (const int& c : ready) {
+        pool.submit([this, &pool, c]() { this->execute(pool, c); });
+    }
+}
+
+std::vector<int> Tasks::TaskGraph::critical_path() const
+{
+    // Number of tasks in the graph
+    const int Nt = this->tasks.size();
+
+    // Accumulated time of the longest chain ending at each task
+    std::vector<double> cost(Nt, 0.0);
+    std::vector<int> parent(Nt, -1);
+
+    // Tasks are stored in topological order as dependencies are added first
+    for (int t = 0; t < Nt; t++) {
+        for (const int& d : this->tasks[t].deps) {
+            if (parent[t] < 0 || cost[d] > cost[parent[t]]) parent[t] = d;
+        }
+        cost[t] = (this->tasks[t].end - this->tasks[t].start);
+        if (parent[t] >= 0) cost[t] += cost[parent[t]];
+    }
+
+    // Follow the chain back from the most expensive task
+    std::vector<int> path;
+    if (Nt == 0) return path;
+
+    int t = std::max_element(cost.begin(), cost.end()) - cost.begin();
+    for (; t >= 0; t = parent[t]) path.push_back(t);
+
+    std::reverse(path.begin(), path.end());
+
+    return path;
+}
+
+void Tasks::TaskGraph::report(std::ostream& stream) const
+{
+    // Wall time of the whole graph
+    double wall = 0.0;
+
+    stream << std::fixed << std::setprecision(4);
+    stream << "# task start(s) end(s) duration(s)\n";
+
+    for (const auto& task : this->tasks) {
+        stream << task.name << " " << task.start << " " << task.end << " "
+               << task.end - task.start << "\n";
+        wall = std::max(wall, task.end);
+    }
+
+    // Time of the critical path and its chain of tasks
+    double critical = 0.0;
+    std::string chain;
+
+    for (const int& t : this->critical_path()) {
+        critical += this->tasks[t].end - this->tasks[t].start;
+        chain += (chain.empty() ? "" : " -> ") + this->tasks[t].name;
+    }
+
+    stream << "# wall time: " << wall << " s\n";
+    stream << "# critical path (" << critical << " s): " << chain << "\n";
+}
+// -- }}}
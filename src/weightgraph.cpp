@@ -0,0 +1,249 @@
+#include <weightgraph.hpp>
+
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+// User defined modules
+#include <taskgraph.hpp>
+#include <numa.hpp>
+#include <perf.hpp>
+
+// Identifier and version of the binary format
+static const char graph_magic[4] = {'N', 'L', 'W', 'G'};
+static const int32_t graph_version = 1;
+
+// -- Construct the graph from the upper triangle of weights (er <= ec) {{{
+WeightGraph::WeightGraph(
+    const Map& map, const std::vector<int>& rows, const std::vector<int>& cols,
+    const std::vector<float>& vals, const float& threshold, const float& hd
+) : Nu(map.Nu), Nv(map.Nv), Nw(map.Nw), threshold(threshold), hd(hd)
+{
+    // Number of rows in the graph
+    const int Ne = get_volume();
+
+    // Count the number of weights in each row, pairs are stored in both rows
+    this->row_ptr.assign(Ne + 1, 0);
+
+    for (size_t n = 0; n < rows.size(); n++) {
+        this->row_ptr[rows[n] + 1]++;
+        if (rows[n] != cols[n]) this->row_ptr[cols[n] + 1]++;
+    }
+
+    for (int e = 0; e < Ne; e++) this->row_ptr[e + 1] += this->row_ptr[e];
+
+    // Fill the rows using the next free position of each row
+    std::vector<int64_t> pos(this->row_ptr.begin(), this->row_ptr.end() - 1);
+
+    this->col.resize(this->row_ptr[Ne]);
+    this->val.resize(this->row_ptr[Ne]);
+
+    for (size_t n = 0; n < rows.size(); n++) {
+
+        if (rows[n] == cols[n]) {
+
+            // The self-weight is added twice by the denoiser
+            this->col[pos[rows[n]]]   = cols[n];
+            this->val[pos[rows[n]]++] = 2 * vals[n];
+
+        } else {
+
+            this->col[pos[rows[n]]]   = cols[n];
+            this->val[pos[rows[n]]++] = vals[n];
+
+            this->col[pos[cols[n]]]   = rows[n];
+            this->val[pos[cols[n]]++] = vals[n];
+        }
+    }
+
+    // -- The weights are collected in any order, so the weights of each row are
+    // -- sorted by column. Graphs computed from the same map are then identical.
+    Tasks::parallel_for(Ne, [&](int begin, int end) {
+
+        std::vector<std::pair<int, float>> row;
+
+        for (int e = begin; e < end; e++) {
+
+            row.clear();
+            for (int64_t n = this->row_ptr[e]; n < this->row_ptr[e + 1]; n++) {
+                row.emplace_back(this->col[n], this->val[n]);
+            }
+
+            std::sort(row.begin(), row.end());
+
+            for (size_t n = 0; n < row.size(); n++) {
+                this->col[this->row_ptr[e] + n] = row[n].first;
+                this->val[this->row_ptr[e] + n] = row[n].second;
+            }
+        }
+    });
+}
+// -- }}}
+
+// -- Load the graph from a file {{{
+WeightGraph::WeightGraph(const std::string& path)
+{
+    std::ifstream stream(path, std::ios::in | std::ios::binary);
+
+    if (!stream.is_open()) throw std::runtime_error("Failed to open graph: " + path);
+
+    // Read and check the header of the file
+    char magic[4]; int32_t version; int64_t nnz;
+
+    stream.read(magic, 4);
+    stream.read(reinterpret_cast<char*>(&version), sizeof(version));
+
+    if (!stream || std::memcmp(magic, graph_magic, 4) != 0 || version != graph_version) {
+        throw std::runtime_error("Not a weight graph file: " + path);
+    }
+
+    stream.read(reinterpret_cast<char*>(&this->Nu), sizeof(int32_t));
+    stream.read(reinterpret_cast<char*>(&this->Nv), sizeof(int32_t));
+    stream.read(reinterpret_cast<char*>(&this->Nw), sizeof(int32_t));
+    stream.read(reinterpret_cast<char*>(&this->threshold), sizeof(float));
+    stream.read(reinterpret_cast<char*>(&this->hd), sizeof(float));
+    stream.read(reinterpret_cast<char*>(&nnz), sizeof(nnz));
+
+    // Size of the header and of the whole file
+    const int64_t header_bytes = stream.tellg();
+    stream.seekg(0, std::ios::end);
+    const int64_t file_bytes = stream.tellg();
+    stream.seekg(header_bytes);
+
+    // -- Check the header before allocating the arrays. The file must contain
+    // -- exactly the arrays announced by the header, so a corrupt or truncated
+    // -- file never leads to large allocations.
+    const int64_t volume = (int64_t) this->Nu * this->Nv * this->Nw;
+
+    if (!stream || this->Nu <= 0 || this->Nv <= 0 || this->Nw <= 0 || volume > INT32_MAX || 
+        nnz < 0 || nnz > volume * volume || 
+        file_bytes - header_bytes != (volume + 1) * (int64_t) sizeof(int64_t) + 
+        nnz * (int64_t) (sizeof(int) + sizeof(float))) {
+        throw std::runtime_error("Invalid header in the graph file: " + path);
+    }
+
+    // Read and check the row pointers, so applying the graph never reads out of bounds
+    const int Ne = get_volume();
+
+    this->row_ptr.resize(Ne + 1);
+    stream.read(reinterpret_cast<char*>(this->row_ptr.data()), row_ptr.size() * sizeof(int64_t));
+
+    if (!stream) throw std::runtime_error("Failed to read all the data from the graph file.");
+
+    if (this->row_ptr[0] != 0 || this->row_ptr[Ne] != nnz) {
+        throw std::runtime_error("Invalid row pointers in the graph file: " + path);
+    }
+
+    for (int e = 0; e < Ne; e++) {
+        if (this->row_ptr[e] > this->row_ptr[e + 1]) {
+            throw std::runtime_error("Invalid row pointers in the graph file: " + path);
+        }
+    }
+
+    // Read the columns and values of the weights
+    this->col.resize(nnz);
+    this->val.resize(nnz);
+
+    stream.read(reinterpret_cast<char*>(this->col.data()), nnz * sizeof(int));
+    stream.read(reinterpret_cast<char*>(this->val.data()), nnz * sizeof(float));
+
+    if (!stream) throw std::runtime_error("Failed to read all the data from the graph file.");
+
+    for (const int& c : this->col) {
+        if (c < 0 || c >= Ne) throw std::runtime_error("Invalid column in the graph file: " + path);
+    }
+}
+// -- }}}
+
+// -- Properties of the graph {{{
+int WeightGraph::get_volume() const { return this->Nu * this->Nv * this->Nw; }
+long int WeightGraph::get_nnz() const { return this->val.size(); }
+// -- }}}
+
+// -- Apply the graph to some values {{{
+void WeightGraph::apply(const float* values, float* out, const float& hd) const
+{
+    // -- The weights are exp(-d2 / (2 * h^2)), so weights for another parameter
+    // -- h' are obtained as w^(h^2 / h'^2). Weights below the threshold for h are
+    // -- still missing for h' > h.
+    const bool reweight = (hd > 0.0f && hd != this->hd);
+    const float power   = reweight ? (this->hd * this->hd) / (hd * hd) : 1.0f;
+
+    // -- The rows are processed in parallel, each thread owning a contiguous
+    // -- shard of out. The values are read at random columns, so each node may
+    // -- read its own copy of them.
+    const Numa::Replicated<float> values_rep(values, get_volume());
+
+    Tasks::parallel_for(get_volume(), [&](int begin, int end) {
+
+        const float* l_values = values_rep.local();
+
+        for (int e = begin; e < end; e++) {
+
+            // Weighted sum of values and sum of weights in the row
+            float sum_val = 0.0f, sum_w = 0.0f;
+
+            for (int64_t n = this->row_ptr[e]; n < this->row_ptr[e + 1]; n++) {
+                const float w = reweight ? std::pow(this->val[n], power) : this->val[n];
+                sum_val += w * l_values[this->col[n]];
+                sum_w   += w;
+            }
+
+            // Rows without weights keep their value instead of producing NaN
+            out[e] = (sum_w > 0.0f) ? sum_val / sum_w : l_values[e];
+        }
+
+        Perf::add_items(this->row_ptr[end] - this->row_ptr[begin], "weights");
+    });
+}
+
+Map WeightGraph::apply(const Map& map, const float& hd) const
+{
+    if (map.Nu != this->Nu || map.Nv != this->Nv || map.Nw != this->Nw) {
+        throw std::runtime_error("Weight graph does not match the map grid");
+    }
+
+    // -- The result only copies the metadata of the map. Its values are released
+    // -- before the graph is applied, so each shard of the output is first touched
+    // -- by the thread, and node, writing it.
+    Map result;
+    result.grid.copy_metadata_from(map.grid);
+    result.hstats          = map.hstats;
+    result.ccp4_header     = map.ccp4_header;
+    result.same_byte_order = map.same_byte_order;
+
+    result.grid.data.resize(map.get_volume());
+    Numa::release_pages(result.data(), map.get_volume() * sizeof(float));
+
+    apply(&map.grid.data[0], result.data(), hd);
+
+    return result;
+}
+// -- }}}
+
+// -- Save the graph into a file {{{
+void WeightGraph::save_graph(const std::string& path) const
+{
+    std::ofstream stream(path, std::ios::out | std::ios::binary);
+
+    if (!stream.is_open()) throw std::runtime_error("Failed to open graph: " + path);
+
+    // Number of weights in the graph
+    const int64_t nnz = get_nnz();
+
+    stream.write(graph_magic, 4);
+    stream.write(reinterpret_cast<const char*>(&graph_version), sizeof(graph_version));
+    stream.write(reinterpret_cast<const char*>(&this->Nu), sizeof(int32_t));
+    stream.write(reinterpret_cast<const char*>(&this->Nv), sizeof(int32_t));
+    stream.write(reinterpret_cast<const char*>(&this->Nw), sizeof(int32_t));
+    stream.write(reinterpret_cast<const char*>(&this->threshold), sizeof(float));
+    stream.write(reinterpret_cast<const char*>(&this->hd), sizeof(float));
+    stream.write(reinterpret_cast<const char*>(&nnz), sizeof(nnz));
+
+    stream.write(reinterpret_cast<const char*>(this->row_ptr.data()), row_ptr.size() * sizeof(int64_t));
+    stream.write(reinterpret_cast<const char*>(this->col.data()), nnz * sizeof(int));
+    stream.write(reinterpret_cast<const char*>(this->val.data()), nnz * sizeof(float));
+}
+// -- }}}